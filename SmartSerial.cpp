@@ -53,7 +53,23 @@ SmartSSP::SmartSSP(HardwareSerial* _serial, int pinTXen) :
   isHardwareSerial = true;
 }
 
+SmartSSP::SmartSSP(Stream* _serial, int pinTXen) :
+  _pinTX(pinTXen), _inputChar()
+{
+  construct();
+  serial = _serial;
+}
+
+SmartSSP::SmartSSP(SmartBusPort* _serial, int pinTXen) :
+  _pinTX(pinTXen), _busPort(_serial), _inputChar()
+{
+  construct();
+  serial = _serial;
+  _busPort->setDriver(LOW);
+}
+
 void SmartSSP::construct() {
+  for(int i=0; i<MSP_MAX_TIME_NODES; i++) _linkTime[i].used = false;
   inPacket.packetType = 0;
   inPacket.nodeID     = 0;
   inPacket.commandID  = 0;
@@ -82,6 +98,7 @@ void SmartSSP::begin() {
 
 /// Begin using custom settings
 void SmartSSP::begin(long baud, uint8_t nodeID) {
+  _baud = baud;
   if(isHardwareSerial) Hardwareserial->begin(_baud=baud);
 <<<<<<< HEAD
   //else serial->begin(baud);
@@ -117,6 +134,7 @@ void SmartSSP::sendPacket() {
   }
   
   enableTX();
+  captureFrame();
   
   #ifdef _VARIANT_ARDUINO_STM32_
   if(!serial->isConnected()) return;
@@ -168,7 +186,6 @@ void SmartSSP::sendPacket() {
 
 /// 
 bool SmartSSP::handle() {
-  static uint8_t processDataFlag = false;
   if(isTX() && (micros() > _txMicros)) disableTX();
   _ready = false;
 <<<<<<< HEAD
@@ -186,69 +203,283 @@ bool SmartSSP::handle() {
   while(serial->available()) {
     char inChar = (char) serial->read();
 >>>>>>> parent of 229edcc... непонятные доработки
-    if(inChar != '\n') {
-      if(inChar != '\r') {
-        if(_inCounter<5) _checkMSP += inChar;
-        else if(_inCounter<MSP_INPUT_BUFFER_SIZE+5) {
+    _rxMicros = micros();
+    if(receive(inChar, _rxMicros)) break; // one frame per call, service() still runs
+<<<<<<< HEAD
+    if(isHardwareSerial) {
+		delay(1);
+		available = Hardwareserial->available();
+	}
+    else available = serial->available();
+	
+=======
+>>>>>>> parent of 229edcc... непонятные доработки
+  }
+  service();
+  return _ready;
+}
+
+/// Deferred callbacks, TX queue and protocol timers
+void SmartSSP::service() {
+  if(_processDataFlag && (micros() >= _callbackTimeoutMicros)) {
+	  _processDataFlag = false;
+      processData();
+  }
+  flushQueue();
+  linkHandle();
+  #ifdef RELIABLE_SUPPORT
+  arqHandle();
+  #endif
+  expireRequests();
+  handler();
+}
+
+#ifdef EVENT_RECEIVE_SUPPORT
+/// Put received char to RX ring (interrupt context)
+void SmartSSP::onReceive(uint8_t data) {
+  uint32_t now  = micros();
+  uint16_t head = _rxRingHead;
+  uint16_t used = head - __atomic_load_n(&_rxRingTail, __ATOMIC_ACQUIRE);
+  _rxMicros = now;
+  if(used >= MSP_RX_RING_SIZE) {
+    _rxOverflows++;
+    return;
+  }
+  _rxRing[head & (MSP_RX_RING_SIZE - 1)] = data;
+  // more than MSP_RX_STAMPS frames waiting: older stamps are overwritten
+  if(data == '\n') _rxStamps[_rxFrames & (MSP_RX_STAMPS - 1)] = now;
+  __atomic_store_n(&_rxRingHead, (uint16_t)(head + 1), __ATOMIC_RELEASE);
+  if(data == '\n') {
+    __atomic_store_n(&_rxFrames, (uint8_t)(_rxFrames + 1), __ATOMIC_RELEASE);
+    if(_onFrame) _onFrame();
+  } else if(used + 1 == MSP_RX_RING_HIGH) {
+    // long frame or late dispatch(): parse it before the ring is full
+    if(_onFrame) _onFrame();
+  }
+}
+
+/// Put block from DMA half/full transfer callback to RX ring
+void SmartSSP::onReceive(const uint8_t* data, uint16_t size) {
+  for(uint16_t i=0; i<size; i++) onReceive(data[i]);
+}
+
+/// Parse chars from RX ring and run callbacks (deferred context)
+bool SmartSSP::dispatch() {
+  if(isTX() && (micros() > _txMicros)) disableTX();
+  _ready = false;
+  uint16_t tail = _rxRingTail;
+  while(tail != __atomic_load_n(&_rxRingHead, __ATOMIC_ACQUIRE)) {
+    char inChar = _rxRing[tail & (MSP_RX_RING_SIZE - 1)];
+    __atomic_store_n(&_rxRingTail, ++tail, __ATOMIC_RELEASE);
+    // chars carry arrival of their frame end, now if it is not received yet
+    uint32_t arrival = micros();
+    if(__atomic_load_n(&_rxFrames, __ATOMIC_ACQUIRE) != _rxDispatched) {
+      arrival = _rxStamps[_rxDispatched & (MSP_RX_STAMPS - 1)];
+    }
+    if(inChar == '\n') _rxDispatched++;
+    if(receive(inChar, arrival)) _ready = true;
+  }
+  service();
+  return _ready;
+}
+
+/// Something for dispatch(): frame, nearly full RX ring or service() work
+bool SmartSSP::pending() {
+  if(__atomic_load_n(&_rxFrames, __ATOMIC_ACQUIRE) != _rxDispatched) return true;
+  uint16_t used = __atomic_load_n(&_rxRingHead, __ATOMIC_ACQUIRE) - _rxRingTail;
+  if(used >= MSP_RX_RING_HIGH) return true;
+  return serviceDue();
+}
+#endif
+
+/// service() has work: RS485 driver release, deferred callback, TX queue, timers
+bool SmartSSP::serviceDue() {
+  if(isTX() && (micros() > _txMicros)) return true;
+  if(_processDataFlag && (micros() >= _callbackTimeoutMicros)) return true;
+  if(_txTail != __atomic_load_n(&_txHead, __ATOMIC_ACQUIRE)) return true;
+  if(linkDue()) return true;
+  #ifdef RELIABLE_SUPPORT
+  if(arqDue()) return true;
+  #endif
+  return requestsDue() || handlerDue();
+}
+
+/// Reserve TX queue slot (multi-producer)
+SmartSSP::QueuedPacket* SmartSSP::reserveQueued() {
+  #if (__GCC_ATOMIC_CHAR_LOCK_FREE == 2)
+  // lock-free CAS (Cortex-M3/M4, dual-core ESP32): safe from ISRs and tasks on any core
+  uint8_t head = __atomic_load_n(&_txHead, __ATOMIC_RELAXED);
+  do {
+    uint8_t tail = __atomic_load_n(&_txTail, __ATOMIC_ACQUIRE);
+    if((uint8_t)(head - tail) >= MSP_TX_QUEUE_SIZE) return nullptr;
+  } while(!__atomic_compare_exchange_n(&_txHead, &head, (uint8_t)(head + 1), true,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+  #else
+  // byte CAS is a libcall here (Cortex-M0, ARMv6-M): short critical
+  // section, safe from ISRs and tasks on a single core only
+  noInterrupts();
+  uint8_t head = _txHead;
+  if((uint8_t)(head - _txTail) >= MSP_TX_QUEUE_SIZE) {
+    interrupts();
+    return nullptr;
+  }
+  _txHead = head + 1;
+  interrupts();
+  #endif
+  return &_txQueue[head & (MSP_TX_QUEUE_SIZE - 1)];
+}
+
+/// Publish filled slot to handle()
+void SmartSSP::commitQueued(QueuedPacket* slot) {
+  __atomic_store_n(&slot->ready, true, __ATOMIC_RELEASE);
+}
+
+/// Send queued frames (single consumer, called from handle())
+void SmartSSP::flushQueue() {
+  uint8_t tail = _txTail;
+  while(tail != __atomic_load_n(&_txHead, __ATOMIC_ACQUIRE)) {
+    QueuedPacket& slot = _txQueue[tail & (MSP_TX_QUEUE_SIZE - 1)];
+    // slot reserved but producer is still filling it - keep order
+    if(!__atomic_load_n(&slot.ready, __ATOMIC_ACQUIRE)) break;
+    if(outPacket.payload) delete[] outPacket.payload;
+    outPacket.packetType = slot.packetType;
+    outPacket.commandID  = slot.commandID;
+    outPacket.datasize   = slot.datasize;
+    outPacket.payload    = new uint8_t[slot.datasize];
+    memcpy(outPacket.payload, slot.payload, slot.datasize);
+    __atomic_store_n(&slot.ready, false, __ATOMIC_RELAXED);
+    __atomic_store_n(&_txTail, ++tail, __ATOMIC_RELEASE);
+    sendPacket();
+  }
+}
+
+/// Feed received char to parser, return true if packet is parsed
+bool SmartSSP::receive(char inChar, uint32_t arrival) {
+  captureByte(CAPTURE_RX, inChar, arrival);
+  if(inChar != '\n') {
+    if(inChar != '\r') {
+      if(_inCounter<5) _checkMSP += inChar;
+      else if(_inCounter<MSP_INPUT_BUFFER_SIZE+5) {
 			_inputChar[_inCounter-5] = inChar;
 		}
 		_inCounter++;
-      }
-    } else {
+    }
+  } else {
+	  _rxFrameMicros = arrival;
 	  #ifdef DEBUG_SERIAL
-	  if(debugPort!=nullptr) debugPort->debug("End of line available : ", available);
+	  if(debugPort!=nullptr) debugPort->debug("End of line");
 	  if(debugPort!=nullptr) debugPort->debug("Data : ", _inputChar);
 	  #endif
-      if(_checkMSP.equals(TAG_MSP)) {
+    if(_checkMSP.equals(TAG_MSP)) {
 	    #ifdef DEBUG_SERIAL
 		if(debugPort!=nullptr) debugPort->debug("Has MSP data");
 		#endif
-        if(parseData()) {
-          //serial->flush();
+      if(parseData()) {
+        //serial->flush();
 		  if(_callbackTimeout) {
-			  processDataFlag = true;
+			  _processDataFlag = true;
 			  _callbackTimeoutMicros = micros() + _callbackTimeout;
 		  } else processData();
-          _ready     = true;
-          _checkMSP  = "";
-          _inCounter = 0;
-          return _ready;
-        }
-        else { // Parse packet error
+        _ready     = true;
+        _checkMSP  = "";
+        _inCounter = 0;
+        return true;
+      }
+      else { // Parse packet error
 		  error();
-		  if(_errorUsage) sendError();
-        }
-      } else {
+		  // reliable delivery recovers by itself, error frame would collide
+		  // (bystanders too: type field of the broken frame is checked)
+		  bool reliable = inPacket.packetType == TYPE_RELIABLE || inPacket.packetType == TYPE_ACK;
+		  if(_errorUsage && !arqActive() && !reliable) sendError();
+      }
+    } else {
 		  
 	  }
-      _checkMSP = "";
-      _inCounter = 0;
-    }
-<<<<<<< HEAD
-    if(isHardwareSerial) {
-		delay(1);
-		available = Hardwareserial->available();
-	}
-    else available = serial->available();
-	
-=======
->>>>>>> parent of 229edcc... непонятные доработки
+    _checkMSP = "";
+    _inCounter = 0;
   }
-  if(processDataFlag && (micros() >= _callbackTimeoutMicros)) {
-	  processDataFlag = false;
-      processData();
+  return false;
+}
+
+/// Feed block of received data (replay, external drivers)
+void SmartSSP::inject(const uint8_t* data, uint16_t size) {
+  for(uint16_t i=0; i<size; i++) {
+    _rxMicros = micros();
+    receive((char)data[i], _rxMicros);
   }
-  handler();
-  return _ready;
+}
+
+/// Append byte to capture record
+void SmartSSP::captureByte(uint8_t direction, char data, uint32_t stamp) {
+  if(!_capture) return;
+  if(_capSize && (direction != _capDirection || _capSize >= MSP_CAPTURE_CHUNK)) captureFlush();
+  if(!_capSize) {
+    _capDirection = direction;
+    _capMicros    = stamp;
+  }
+  _capBuffer[_capSize++] = data;
+  if(data == '\n') captureFlush();
+}
+
+/// Append field of TX frame to capture
+void SmartSSP::captureField(char tag, uint8_t data, uint32_t stamp) {
+  static const char hex[] = "0123456789ABCDEF";
+  if(tag) captureByte(CAPTURE_TX, tag, stamp);
+  captureByte(CAPTURE_TX, hex[data >> 4], stamp);
+  captureByte(CAPTURE_TX, hex[data & 0x0F], stamp);
+}
+
+/// Append outPacket to capture as it is sent
+void SmartSSP::captureFrame() {
+  if(!_capture) return;
+  uint32_t now = micros();
+  for(const char* tag = TAG_MSP; *tag; tag++) captureByte(CAPTURE_TX, *tag, now);
+  captureField(TAG_TYPE[0], outPacket.packetType, now);
+  captureField(TAG_NODE[0], outPacket.nodeID, now);
+  captureField(TAG_CMD[0],  outPacket.commandID, now);
+  captureField(TAG_SIZE[0], outPacket.datasize, now);
+  captureByte(CAPTURE_TX, TAG_DATA[0], now);
+  for(int i=0; i<outPacket.datasize; i++) captureField(0, outPacket.payload[i], now);
+  captureField(TAG_CRC[0],  outPacket.parity, now);
+  captureByte(CAPTURE_TX, '\r', now);
+  captureByte(CAPTURE_TX, '\n', now);
+}
+
+/// Write capture record: [size][direction][micros, 4 bytes LE][data]
+void SmartSSP::captureFlush() {
+  if(!_capture || !_capSize) return;
+  // delay since previous record: 32-bit micros() wrap does not matter
+  uint32_t delay = _capMicros - _capLastMicros;
+  _capLastMicros = _capMicros;
+  uint8_t header[CAPTURE_HEADER_SIZE] = {
+    _capSize, _capDirection,
+    (uint8_t)(delay >> 0),  (uint8_t)(delay >> 8),
+    (uint8_t)(delay >> 16), (uint8_t)(delay >> 24)
+  };
+  _capture->write(header, CAPTURE_HEADER_SIZE);
+  _capture->write(_capBuffer, _capSize);
+  _capSize = 0;
+}
+
+/// Start/stop capture of RX & TX traffic (nullptr - stop)
+void SmartSSP::setCapture(Print* capture) {
+  captureFlush();
+  _capture       = capture;
+  _capLastMicros = micros();
 }
 
 void SmartSSP::processData() {
   long _payload;
+  if(_frameRing) {
+    _frameRing->publish(_portID, inPacket.nodeID, inPacket.packetType, inPacket.commandID,
+                        inPacket.payload, inPacket.datasize);
+  }
   switch(inPacket.packetType) {
     case TYPE_REPLY :
       break;
     case TYPE_ERROR :
-	  sendPacket();
+	  // resend last packet, but never answer error by error
+	  if(outPacket.packetType != TYPE_ERROR && !arqActive()) sendPacket();
       break;
     case TYPE_EVENT :
       _payload  = inPacket.payload[0] << 24;
@@ -273,6 +504,29 @@ void SmartSSP::processData() {
     case TYPE_RESET :
 	  reset();
       break;
+    case TYPE_TYPED :
+	  typedReceive();
+      break;
+    case TYPE_ENDIAN :
+	  endianReceive();
+      break;
+    case TYPE_LINK :
+	  linkReceive();
+      break;
+    case TYPE_TIME :
+	  timeReceive();
+      break;
+    case TYPE_STAMPED :
+	  stampedReceive();
+      break;
+    #ifdef RELIABLE_SUPPORT
+    case TYPE_RELIABLE :
+	  arqReceive();
+      break;
+    case TYPE_ACK :
+	  arqAcknowledge();
+      break;
+    #endif
     default : break;
   }
   
@@ -409,6 +663,11 @@ uint8_t SmartSSP::getPacketType() {
   return inPacket.packetType;
 }
 
+/// Get nodeID
+uint8_t SmartSSP::getNodeID() {
+  return inPacket.nodeID;
+}
+
 /// Get commandID
 uint8_t SmartSSP::getCommandID() {
   return inPacket.commandID;
@@ -423,3 +682,911 @@ uint8_t SmartSSP::getPayload(byte num) {
 uint8_t* SmartSSP::getPayload() {
   return &inPacket.payload[0];
 }
+
+/// Size of typed value
+static uint8_t valueSize(uint8_t code) {
+  switch(code) {
+    case VALUE_INT8   : case VALUE_UINT8  : return 1;
+    case VALUE_INT16  : case VALUE_UINT16 : return 2;
+    case VALUE_INT32  : case VALUE_UINT32 : case VALUE_FLOAT  : return 4;
+    case VALUE_INT64  : case VALUE_UINT64 : case VALUE_DOUBLE : return 8;
+    default : return 0;
+  }
+}
+
+/// Largest payload receiver parses: LINK_MAX_FRAME or smaller one of peer
+uint8_t SmartSSP::maxPayload() {
+  if(_peerMaxFrame && _peerMaxFrame < LINK_MAX_FRAME) return _peerMaxFrame;
+  return LINK_MAX_FRAME;
+}
+
+/// Send typed values in byte order of peer
+bool SmartSSP::sendTyped(uint8_t dataID, uint8_t code, const uint8_t* values, uint8_t size, uint8_t count) {
+  if(!size || size * count + 1 > maxPayload()) return false;
+  if(outPacket.payload) delete[] outPacket.payload;
+  outPacket.packetType = TYPE_TYPED;
+  outPacket.commandID  = dataID;
+  outPacket.datasize   = size * count + 1;
+  outPacket.payload    = new uint8_t[outPacket.datasize];
+  outPacket.payload[0] = code | _wireOrder;
+  if(_wireOrder == NATIVE_ORDER) {
+    memcpy(&outPacket.payload[1], values, size * count);
+  } else {
+    uint8_t* out = &outPacket.payload[1];
+    for(uint8_t n=0; n<count; n++, values += size) {
+      for(uint8_t i=0; i<size; i++) *out++ = values[size - 1 - i];
+    }
+  }
+  sendPacket();
+  return true;
+}
+
+/// Announce own byte order
+void SmartSSP::negotiateEndian() {
+  if(outPacket.payload) delete[] outPacket.payload;
+  outPacket.packetType = TYPE_ENDIAN;
+  outPacket.commandID  = ENDIAN_ANNOUNCE;
+  outPacket.datasize   = 1;
+  outPacket.payload    = new uint8_t[1];
+  outPacket.payload[0] = NATIVE_ORDER;
+  sendPacket();
+}
+
+/// Receive TYPE_ENDIAN: remember peer order, answer announce
+void SmartSSP::endianReceive() {
+  if(inPacket.datasize < 1) return;
+  _wireOrder = inPacket.payload[0] & VALUE_BIG_ENDIAN;
+  if(inPacket.commandID != ENDIAN_ANNOUNCE) return;
+  if(outPacket.payload) delete[] outPacket.payload;
+  outPacket.packetType = TYPE_ENDIAN;
+  outPacket.commandID  = ENDIAN_REPLY;
+  outPacket.datasize   = 1;
+  outPacket.payload    = new uint8_t[1];
+  outPacket.payload[0] = NATIVE_ORDER;
+  sendPacket();
+}
+
+/// Receive TYPE_TYPED: convert values to native order in place
+void SmartSSP::typedReceive() {
+  if(inPacket.datasize < 1) return;
+  uint8_t code = inPacket.payload[0] & ~VALUE_BIG_ENDIAN;
+  uint8_t size = valueSize(code);
+  if(!size) return;
+  int count = (inPacket.datasize - 1) / size;
+  uint8_t* values = &inPacket.payload[1];
+  if((inPacket.payload[0] & VALUE_BIG_ENDIAN) != NATIVE_ORDER) {
+    for(int n=0; n<count; n++, values += size) {
+      for(uint8_t i=0; i<size/2; i++) {
+        uint8_t tmp = values[i];
+        values[i] = values[size - 1 - i];
+        values[size - 1 - i] = tmp;
+      }
+    }
+  }
+  // move to start of payload buffer to get values aligned
+  memmove(inPacket.payload, &inPacket.payload[1], count * size);
+  typed(inPacket.commandID, code, inPacket.payload, count);
+}
+
+/// Read 4 bytes BE
+static uint32_t readMicros(const uint8_t* data) {
+  return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+/// Write 4 bytes BE
+static void writeMicros(uint8_t* data, uint32_t value) {
+  data[0] = value >> 24;
+  data[1] = value >> 16;
+  data[2] = value >> 8;
+  data[3] = value >> 0;
+}
+
+/// Line time of frame with datasize bytes of payload
+uint32_t SmartSSP::frameMicros(uint8_t datasize) {
+  // tag, T.. N.. I.. S.., P, payload, Q.., \r\n
+  uint32_t chars = strlen(TAG_MSP) + 4 * 3 + 1 + datasize * 2 + 3 + 2;
+  return chars * (100000000UL / _baud) / 10;
+}
+
+/// Send TIME_PING to nodeID
+void SmartSSP::ping(uint8_t nodeID) {
+  uint8_t ownNodeID = outPacket.nodeID;
+  if(outPacket.payload) delete[] outPacket.payload;
+  outPacket.packetType = TYPE_TIME;
+  outPacket.nodeID     = nodeID;
+  outPacket.commandID  = TIME_PING;
+  outPacket.datasize   = 5;
+  outPacket.payload    = new uint8_t[5];
+  outPacket.payload[0] = ownNodeID;
+  writeMicros(&outPacket.payload[1], micros());
+  sendPacket();
+  outPacket.nodeID     = ownNodeID;
+}
+
+/// Time statistics of nodeID, nullptr if never answered
+SmartLinkTime* SmartSSP::linkTime(uint8_t nodeID) {
+  for(int i=0; i<MSP_MAX_TIME_NODES; i++) {
+    if(_linkTime[i].used && _linkTime[i].nodeID == nodeID) return &_linkTime[i];
+  }
+  return nullptr;
+}
+
+/// Translate node micros() to local micros(), unchanged if node is not synced
+uint32_t SmartSSP::nodeToLocal(uint8_t nodeID, uint32_t nodeMicros) {
+  SmartLinkTime* time = linkTime(nodeID);
+  if(!time) return nodeMicros;
+  uint32_t local = nodeMicros - time->offset;
+  return local - (int32_t)((int32_t)(local - time->syncMicros) * time->drift / 1000000.0f);
+}
+
+/// Receive TYPE_TIME: answer ping, update statistics by pong
+void SmartSSP::timeReceive() {
+  // start of frame: ping and pong differ in length, so line time must not
+  // get into the offset
+  uint32_t received = _rxFrameMicros - frameMicros(inPacket.datasize);
+  if(inPacket.commandID == TIME_PING) {
+    if(inPacket.nodeID != outPacket.nodeID || inPacket.datasize < 5) return;
+    uint8_t  pinger = inPacket.payload[0];
+    uint32_t t1     = readMicros(&inPacket.payload[1]);
+    if(outPacket.payload) delete[] outPacket.payload;
+    outPacket.packetType = TYPE_TIME;
+    outPacket.commandID  = TIME_PONG;
+    outPacket.datasize   = 13;
+    outPacket.payload    = new uint8_t[13];
+    outPacket.payload[0] = pinger;
+    writeMicros(&outPacket.payload[1], t1);
+    writeMicros(&outPacket.payload[5], received);
+    writeMicros(&outPacket.payload[9], micros());
+    sendPacket();
+    return;
+  }
+  if(inPacket.commandID != TIME_PONG || inPacket.datasize < 13) return;
+  // pong to other node's ping: its timestamps are not ours
+  if(inPacket.payload[0] != outPacket.nodeID) return;
+  uint32_t t1 = readMicros(&inPacket.payload[1]);
+  uint32_t t2 = readMicros(&inPacket.payload[5]);
+  uint32_t t3 = readMicros(&inPacket.payload[9]);
+  uint32_t t4 = received;
+  uint32_t rtt    = (_rxFrameMicros - t1) - (t3 - t2) + frameMicros(5); // t2 is start of ping
+  int32_t  offset = ((int32_t)(t2 - t1) + (int32_t)(t3 - t4)) / 2;
+  SmartLinkTime* time = linkTime(inPacket.nodeID);
+  if(!time) {
+    for(int i=0; i<MSP_MAX_TIME_NODES && !time; i++) {
+      if(!_linkTime[i].used) time = &_linkTime[i];
+    }
+    if(!time) return;
+    time->used       = true;
+    time->nodeID     = inPacket.nodeID;
+    time->samples    = 0;
+    time->rttMin     = rtt;
+    time->rttMax     = rtt;
+    time->rttAvg     = rtt;
+    time->offset     = offset;
+    time->drift      = 0;
+    time->syncMicros = t4;
+  }
+  time->samples++;
+  time->rtt    = rtt;
+  time->rttMin = min(time->rttMin, rtt);
+  time->rttMax = max(time->rttMax, rtt);
+  time->rttAvg = (7 * time->rttAvg + rtt) / 8;
+  // offset error is up to rtt/2: trust only samples close to best RTT
+  if(rtt > time->rttMin + time->rttMin / 2) return;
+  uint32_t elapsed = t4 - time->syncMicros;
+  if(elapsed) {
+    float drift = (float)(offset - time->offset) * 1000000.0f / elapsed;
+    time->drift = (time->samples > 2) ? (7 * time->drift + drift) / 8 : drift;
+  }
+  time->offset     = offset;
+  time->syncMicros = t4;
+}
+
+/// Receive TYPE_STAMPED: translate sender time to local time
+void SmartSSP::stampedReceive() {
+  if(inPacket.datasize < 4) return;
+  uint32_t local = nodeToLocal(inPacket.nodeID, readMicros(inPacket.payload));
+  stamped(inPacket.commandID, &inPacket.payload[4], inPacket.datasize - 4, local);
+}
+
+/// RS485 driver enable: pin and driver of simulated bus port
+void SmartSSP::driveTX(bool state) {
+  if(_pinTX != PIN_UNCONNECTED) digitalWrite(_pinTX, state);
+  if(_busPort) _busPort->setDriver(state);
+}
+
+/// Standard baud rates for link upgrade
+static const uint32_t linkBauds[] = {
+  9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600, 1000000, 2000000
+};
+
+/// Reopen port at new baud rate after current TX is complete
+void SmartSSP::setBaud(uint32_t baud) {
+  if(!isHardwareSerial) return;
+  Hardwareserial->flush();
+  Hardwareserial->begin(_baud = baud);
+}
+
+/// Send TYPE_LINK packet
+void SmartSSP::linkSend(uint8_t command, const uint8_t* payload, uint8_t size) {
+  if(outPacket.payload) delete[] outPacket.payload;
+  outPacket.packetType = TYPE_LINK;
+  outPacket.commandID  = command;
+  outPacket.datasize   = size;
+  outPacket.payload    = new uint8_t[size];
+  memcpy(outPacket.payload, payload, size);
+  sendPacket();
+}
+
+/// Send TYPE_LINK packet with baud rate
+void SmartSSP::linkSendBaud(uint8_t command, uint32_t baud) {
+  uint8_t payload[4] = { (uint8_t)(baud >> 24), (uint8_t)(baud >> 16), (uint8_t)(baud >> 8), (uint8_t)baud };
+  linkSend(command, payload, 4);
+}
+
+/// Send own capabilities
+void SmartSSP::linkSendCaps(uint8_t command) {
+  uint32_t maxBaud = isHardwareSerial ? max(_maxBaud, _baud) : 0;
+  uint8_t caps[LINK_CAPS_SIZE + 1] = {
+    LINK_VERSION,
+    (uint8_t)(maxBaud >> 24), (uint8_t)(maxBaud >> 16), (uint8_t)(maxBaud >> 8), (uint8_t)maxBaud,
+    LINK_FRAMING_HEX, LINK_CHECKSUM_XOR, LINK_MAX_FRAME, NATIVE_ORDER, _linkNonce
+  };
+  linkSend(command, caps, LINK_CAPS_SIZE + 1);
+}
+
+/// Simultaneous LINK_HELLO: lower nodeID, then lower nonce proposes baud
+bool SmartSSP::linkLeads() {
+  if(outPacket.nodeID != inPacket.nodeID) return outPacket.nodeID < inPacket.nodeID;
+  if(inPacket.datasize <= LINK_CAPS_SIZE) return false; // peer without nonce leads
+  return _linkNonce < inPacket.payload[LINK_CAPS_SIZE];   // same nonce: no upgrade
+}
+
+/// Begin handshake with peer
+void SmartSSP::startLink() {
+  _linkState   = LINK_HELLO_SENT;
+  _linkRetries = 0;
+  _linkMillis  = millis();
+  _linkNonce   = micros() ^ (micros() >> 8);
+  linkSendCaps(LINK_HELLO);
+}
+
+/// Propose fastest common baud rate lower than 'below'
+void SmartSSP::linkPropose(uint32_t below) {
+  uint32_t common = min(max(_maxBaud, _baud), _peerMaxBaud);
+  _linkTarget = 0;
+  for(uint8_t i=0; i<sizeof(linkBauds)/sizeof(linkBauds[0]); i++) {
+    if(linkBauds[i] <= common && linkBauds[i] < below && linkBauds[i] > _baud) _linkTarget = linkBauds[i];
+  }
+  if(!_linkTarget) {
+    _linkState = LINK_READY;
+    return;
+  }
+  _linkState   = LINK_SWITCH_SENT;
+  _linkRetries = 0;
+  _linkMillis  = millis();
+  linkSendBaud(LINK_SWITCH, _linkTarget);
+}
+
+/// Receive TYPE_LINK
+void SmartSSP::linkReceive() {
+  uint32_t baud = 0;
+  if(inPacket.datasize >= 4) {
+    baud = ((uint32_t)inPacket.payload[0] << 24) | ((uint32_t)inPacket.payload[1] << 16) |
+           ((uint32_t)inPacket.payload[2] << 8)  |  (uint32_t)inPacket.payload[3];
+  }
+  // point-to-point: one peer from LINK_HELLO until the handshake ends
+  bool idle = _linkState == LINK_IDLE || _linkState == LINK_HELLO_SENT || _linkState == LINK_READY;
+  bool hello = inPacket.commandID == LINK_HELLO || inPacket.commandID == LINK_HELLO_REPLY;
+  if(inPacket.nodeID != _linkPeer && !(hello && idle)) return;
+  switch(inPacket.commandID) {
+    case LINK_HELLO :
+    case LINK_HELLO_REPLY :
+      if(inPacket.datasize < LINK_CAPS_SIZE) return;
+      if(!(inPacket.payload[5] & LINK_FRAMING_HEX) || !(inPacket.payload[6] & LINK_CHECKSUM_XOR)) return;
+      _linkPeer     = inPacket.nodeID;
+      baud = ((uint32_t)inPacket.payload[1] << 24) | ((uint32_t)inPacket.payload[2] << 16) |
+             ((uint32_t)inPacket.payload[3] << 8)  |  (uint32_t)inPacket.payload[4];
+      _peerMaxBaud  = baud;
+      _peerMaxFrame = inPacket.payload[7];
+      _wireOrder    = inPacket.payload[8] & VALUE_BIG_ENDIAN;
+      if(inPacket.commandID == LINK_HELLO) {
+        linkSendCaps(LINK_HELLO_REPLY);
+        // both sides started at once: leader proposes on LINK_HELLO_REPLY
+        if(_linkState == LINK_IDLE || (_linkState == LINK_HELLO_SENT && !linkLeads())) {
+          _linkState = LINK_READY;
+        }
+      } else if(_linkState == LINK_HELLO_SENT) {
+        linkPropose(0xFFFFFFFF);
+      }
+      break;
+    case LINK_SWITCH :
+      if(!isHardwareSerial || !baud || baud > max(_maxBaud, _baud)) {
+        linkSendBaud(LINK_SWITCH_ACK, 0);
+        return;
+      }
+      linkSendBaud(LINK_SWITCH_ACK, baud);
+      _linkFallback = _baud;
+      setBaud(baud);
+      _linkState  = LINK_WAIT_VERIFY;
+      _linkMillis = millis();
+      break;
+    case LINK_SWITCH_ACK :
+      if(_linkState != LINK_SWITCH_SENT) return;
+      if(baud != _linkTarget) {
+        _linkState = LINK_READY; // peer rejected, keep current baud
+        return;
+      }
+      _linkFallback = _baud;
+      setBaud(baud);
+      _linkState   = LINK_VERIFY_SENT;
+      _linkRetries = 0;
+      _linkMillis  = millis();
+      linkSend(LINK_VERIFY, nullptr, 0);
+      break;
+    case LINK_VERIFY :
+      linkSend(LINK_VERIFY_ACK, nullptr, 0);
+      if(_linkState != LINK_WAIT_VERIFY) return;
+      // new baud works both ways only when initiator confirms it
+      _linkState   = LINK_WAIT_CONFIRM;
+      _linkRetries = 0;
+      _linkMillis  = millis();
+      break;
+    case LINK_VERIFY_ACK :
+      if(_linkState == LINK_VERIFY_SENT) {
+        _linkState   = LINK_READY;
+        _linkRetries = 0;
+      } else if(_linkState != LINK_READY || _baud == _linkFallback) {
+        return;
+      } else if(++_linkRetries >= MSP_LINK_RETRIES) {
+        // last repeat of VERIFY_ACK: CONFIRM does not get through and
+        // responder falls back, so does initiator
+        setBaud(_linkFallback);
+        return;
+      }
+      // every VERIFY_ACK: responder repeats it until confirmed
+      linkSend(LINK_CONFIRM, nullptr, 0);
+      break;
+    case LINK_CONFIRM :
+      if(_linkState == LINK_WAIT_CONFIRM) _linkState = LINK_READY;
+      break;
+    default : break;
+  }
+}
+
+/// Retries and fallback of link handshake
+/// Link timer expired: linkHandle() retries or falls back
+bool SmartSSP::linkDue() {
+  switch(_linkState) {
+    case LINK_HELLO_SENT :
+    case LINK_SWITCH_SENT :
+    case LINK_VERIFY_SENT :
+    case LINK_WAIT_CONFIRM :
+      return millis() - _linkMillis >= MSP_LINK_TIMEOUT;
+    case LINK_WAIT_VERIFY :
+      return millis() - _linkMillis >= MSP_LINK_TIMEOUT * (MSP_LINK_RETRIES + 2);
+    default : return false;
+  }
+}
+
+void SmartSSP::linkHandle() {
+  switch(_linkState) {
+    case LINK_HELLO_SENT :
+    case LINK_SWITCH_SENT :
+    case LINK_VERIFY_SENT :
+      if(millis() - _linkMillis < MSP_LINK_TIMEOUT) return;
+      _linkMillis = millis();
+      if(++_linkRetries <= MSP_LINK_RETRIES) {
+        if(_linkState == LINK_HELLO_SENT)       linkSendCaps(LINK_HELLO);
+        else if(_linkState == LINK_SWITCH_SENT) linkSendBaud(LINK_SWITCH, _linkTarget);
+        else                                    linkSend(LINK_VERIFY, nullptr, 0);
+        return;
+      }
+      if(_linkState == LINK_HELLO_SENT) _linkState = LINK_IDLE;  // no peer
+      else if(_linkState == LINK_SWITCH_SENT) _linkState = LINK_READY;
+      else {
+        // new baud does not work: return and try next lower one
+        setBaud(_linkFallback);
+        linkPropose(_linkTarget);
+      }
+      break;
+    case LINK_WAIT_VERIFY :
+      // initiator gives up after all VERIFY retries
+      if(millis() - _linkMillis < MSP_LINK_TIMEOUT * (MSP_LINK_RETRIES + 2)) return;
+      setBaud(_linkFallback);
+      _linkState = LINK_READY;
+      break;
+    case LINK_WAIT_CONFIRM :
+      // VERIFY_ACK lost or initiator gone: back to the old baud like it
+      if(millis() - _linkMillis < MSP_LINK_TIMEOUT) return;
+      _linkMillis = millis();
+      if(++_linkRetries <= MSP_LINK_RETRIES) {
+        linkSend(LINK_VERIFY_ACK, nullptr, 0);
+        return;
+      }
+      setBaud(_linkFallback);
+      _linkState = LINK_READY;
+      break;
+    default : break;
+  }
+}
+
+#ifdef RELIABLE_SUPPORT
+/// Put frame to send window
+bool SmartSSP::arqSend(uint8_t dataID, const uint8_t* data, uint8_t length, uint8_t nodeID) {
+  if(length > MSP_ARQ_PAYLOAD_SIZE) return false;
+  if(_arqActive && nodeID != _arqPeer) return false; // sequences belong to one peer
+  if((uint8_t)(_arqNext - _arqBase) >= _arqWindow) return false;
+  ArqFrame& frame = _arqTx[_arqNext & (MSP_ARQ_WINDOW - 1)];
+  frame.used          = true;
+  frame.sent          = false;
+  frame.acked         = false;
+  frame.retransmitted = false;
+  frame.sequence      = _arqNext++;
+  _arqActive          = true;
+  _arqPeer            = nodeID;
+  frame.commandID     = dataID;
+  frame.datasize      = length;
+  memcpy(frame.payload, data, length);
+  if(lineIdle()) arqTransmit(frame);
+  return true;
+}
+
+/// Send (or resend) frame from window
+void SmartSSP::arqTransmit(ArqFrame& frame) {
+  if(outPacket.payload) delete[] outPacket.payload;
+  uint8_t ownNodeID = outPacket.nodeID;
+  outPacket.packetType = TYPE_RELIABLE;
+  outPacket.commandID  = frame.commandID;
+  outPacket.datasize   = frame.datasize + 4;
+  outPacket.payload    = new uint8_t[outPacket.datasize];
+  outPacket.payload[0] = ownNodeID;
+  outPacket.payload[1] = frame.sequence;
+  memcpy(&outPacket.payload[2], frame.payload, frame.datasize);
+  uint16_t crc = arqCrc(_arqPeer, frame.commandID, outPacket.payload, frame.datasize + 2);
+  outPacket.payload[frame.datasize + 2] = crc >> 8;
+  outPacket.payload[frame.datasize + 3] = crc;
+  frame.sent       = true;
+  frame.sentMicros = micros();
+  outPacket.nodeID = _arqPeer;
+  sendPacket();
+  outPacket.nodeID = ownNodeID;
+}
+
+/// Send cumulative ACK with SACK of frames buffered out of order
+void SmartSSP::arqSendAck() {
+  uint8_t sack = 0;
+  for(uint8_t i=0; i<MSP_ARQ_WINDOW-1; i++) {
+    uint8_t seq = _arqExpected + 1 + i;
+    ArqFrame& frame = _arqRx[seq & (MSP_ARQ_WINDOW - 1)];
+    if(frame.used && frame.sequence == seq) sack |= 1 << i;
+  }
+  if(outPacket.payload) delete[] outPacket.payload;
+  uint8_t ownNodeID = outPacket.nodeID;
+  outPacket.packetType = TYPE_ACK;
+  outPacket.commandID  = 0;
+  outPacket.datasize   = 5;
+  outPacket.payload    = new uint8_t[5];
+  outPacket.payload[0] = ownNodeID;
+  outPacket.payload[1] = _arqExpected;
+  outPacket.payload[2] = sack;
+  uint16_t crc = arqCrc(_arqPeer, 0, outPacket.payload, 3);
+  outPacket.payload[3] = crc >> 8;
+  outPacket.payload[4] = crc;
+  _arqAckPending       = false;
+  outPacket.nodeID     = _arqPeer;
+  sendPacket();
+  outPacket.nodeID     = ownNodeID;
+}
+
+/// Receive TYPE_RELIABLE: deliver in order, buffer out of order, ACK later
+void SmartSSP::arqReceive() {
+  if(inPacket.nodeID != outPacket.nodeID) return; // frame for other node
+  if(inPacket.datasize < 4 || !arqCheck()) return; // no ACK: sender retransmits
+  uint8_t sender = inPacket.payload[0];
+  if(_arqActive && sender != _arqPeer) return; // sequences belong to one peer
+  _arqActive = true;
+  _arqPeer   = sender;
+  uint8_t sequence = inPacket.payload[1];
+  uint8_t offset   = sequence - _arqExpected;
+  uint8_t length   = inPacket.datasize - 4;
+  if(offset == 0) {
+    array(inPacket.commandID, &inPacket.payload[2], length);
+    _arqExpected++;
+    // deliver frames which were waiting for this one
+    ArqFrame* next = &_arqRx[_arqExpected & (MSP_ARQ_WINDOW - 1)];
+    while(next->used && next->sequence == _arqExpected) {
+      next->used = false;
+      array(next->commandID, next->payload, next->datasize);
+      next = &_arqRx[++_arqExpected & (MSP_ARQ_WINDOW - 1)];
+    }
+  } else if(offset < MSP_ARQ_WINDOW && length <= MSP_ARQ_PAYLOAD_SIZE) {
+    ArqFrame& frame = _arqRx[sequence & (MSP_ARQ_WINDOW - 1)];
+    frame.used      = true;
+    frame.sequence  = sequence;
+    frame.commandID = inPacket.commandID;
+    frame.datasize  = length;
+    memcpy(frame.payload, &inPacket.payload[2], frame.datasize);
+  } // else: duplicate of delivered frame, ACK again
+  // one ACK for a burst of frames, when sender stops driving the line
+  _arqAckPending = true;
+}
+
+/// Receive TYPE_ACK: slide window, retransmit holes reported by SACK
+void SmartSSP::arqAcknowledge() {
+  if(inPacket.nodeID != outPacket.nodeID) return; // ACK for other node
+  if(inPacket.datasize < 5 || !arqCheck()) return;
+  if(!_arqActive || inPacket.payload[0] != _arqPeer) return;
+  uint8_t cumulative = inPacket.payload[1];
+  uint8_t sack       = inPacket.payload[2];
+  uint8_t inFlight   = _arqNext - _arqBase;
+  if((uint8_t)(cumulative - _arqBase) > inFlight) return; // stale ACK
+  uint32_t now = micros();
+  ArqFrame* sample = nullptr;
+  while(_arqBase != cumulative) {
+    ArqFrame& frame = _arqTx[_arqBase++ & (MSP_ARQ_WINDOW - 1)];
+    if(!frame.acked && !frame.retransmitted) sample = &frame; // Karn's rule
+    frame.used = false;
+  }
+  uint8_t highest = 0;
+  for(uint8_t i=0; i<MSP_ARQ_WINDOW-1; i++) {
+    if(!(sack & (1 << i))) continue;
+    uint8_t seq = cumulative + 1 + i;
+    if((uint8_t)(seq - _arqBase) >= (uint8_t)(_arqNext - _arqBase)) break;
+    ArqFrame& frame = _arqTx[seq & (MSP_ARQ_WINDOW - 1)];
+    if(!frame.acked && !frame.retransmitted) sample = &frame;
+    frame.acked = true;
+    highest = i + 1;
+  }
+  if(sample) arqSample(now - sample->sentMicros);
+  // frames before highest selectively acknowledged one are lost
+  for(uint8_t i=0; i<highest; i++) {
+    ArqFrame& frame = _arqTx[(uint8_t)(cumulative + i) & (MSP_ARQ_WINDOW - 1)];
+    if(frame.used && frame.sent && !frame.acked && !frame.retransmitted) {
+      frame.retransmitted = true;
+      _arqRetransmits++;
+      arqTransmit(frame);
+    }
+  }
+}
+
+/// CRC-16/CCITT of receiver nodeID, dataID and payload
+uint16_t SmartSSP::arqCrc(uint8_t nodeID, uint8_t commandID, const uint8_t* data, uint8_t length) {
+  uint16_t crc = 0xFFFF;
+  for(int i=-2; i<length; i++) {
+    crc ^= (uint16_t)(i < -1 ? nodeID : i < 0 ? commandID : data[i]) << 8;
+    for(uint8_t bit=0; bit<8; bit++) crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+/// Check CRC16 at the end of received reliable frame or ACK
+bool SmartSSP::arqCheck() {
+  uint8_t  length = inPacket.datasize - 2;
+  uint16_t crc    = (inPacket.payload[length] << 8) | inPacket.payload[length + 1];
+  if(arqCrc(inPacket.nodeID, inPacket.commandID, inPacket.payload, length) == crc) return true;
+  _arqCorrupted++;
+  return false;
+}
+
+/// Update RTO by RTT sample (RFC 6298)
+void SmartSSP::arqSample(uint32_t rtt) {
+  if(!_arqSRTT) {
+    _arqSRTT   = rtt;
+    _arqRTTVAR = rtt / 2;
+  } else {
+    uint32_t delta = _arqSRTT > rtt ? _arqSRTT - rtt : rtt - _arqSRTT;
+    _arqRTTVAR = (3 * _arqRTTVAR + delta) / 4;
+    _arqSRTT   = (7 * _arqSRTT + rtt) / 8;
+  }
+  _arqRTO = constrain(_arqSRTT + 4 * _arqRTTVAR, MSP_ARQ_MIN_RTO, MSP_ARQ_MAX_RTO);
+}
+
+/// arqHandle() has ACK or frame to send
+bool SmartSSP::arqDue() {
+  if(!lineIdle()) return false;
+  if(_arqAckPending) return true;
+  for(uint8_t seq = _arqBase; seq != _arqNext; seq++) {
+    ArqFrame& frame = _arqTx[seq & (MSP_ARQ_WINDOW - 1)];
+    if(frame.acked) continue;
+    if(!frame.sent || micros() - frame.sentMicros >= _arqRTO) return true;
+  }
+  return false;
+}
+
+/// Send delayed ACK and frames, retransmit frames not acknowledged in RTO
+void SmartSSP::arqHandle() {
+  if(!lineIdle()) return;
+  if(_arqAckPending) arqSendAck();
+  bool expired = false;
+  for(uint8_t seq = _arqBase; seq != _arqNext; seq++) {
+    ArqFrame& frame = _arqTx[seq & (MSP_ARQ_WINDOW - 1)];
+    if(frame.acked) continue;
+    if(!frame.sent) {
+      arqTransmit(frame);
+      continue;
+    }
+    if(micros() - frame.sentMicros < _arqRTO) continue;
+    frame.retransmitted = true;
+    _arqRetransmits++;
+    arqTransmit(frame);
+    expired = true;
+  }
+  if(expired) _arqRTO = min(_arqRTO * 2, (uint32_t)MSP_ARQ_MAX_RTO); // back off
+}
+#endif
+
+/// Write frame to ring, oldest record is overwritten
+void SmartFrameRing::publish(uint8_t port, uint8_t nodeID, uint8_t packetType, uint8_t commandID,
+                             const uint8_t* payload, uint8_t datasize) {
+  if(!capacity) return;
+  uint32_t sequence = _written;
+  SmartFrame* frame = slot(sequence);
+  // mark record as being rewritten for readers still holding it,
+  // the mark is visible before any field changes
+  __atomic_store_n(&frame->sequence, sequence - 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  frame->timestamp  = micros();
+  frame->port       = port;
+  frame->nodeID     = nodeID;
+  frame->packetType = packetType;
+  frame->commandID  = commandID;
+  frame->datasize   = datasize;
+  memcpy(frame->payload, payload, min((int)datasize, MSP_RING_PAYLOAD_SIZE));
+  __atomic_store_n(&frame->sequence, sequence, __ATOMIC_RELEASE);
+  __atomic_store_n(&_written, sequence + 1, __ATOMIC_RELEASE);
+}
+
+/// Read next frame
+const SmartFrame* SmartFrameReader::read() {
+  uint32_t written = ring->written();
+  if(next == written) return nullptr;
+  if(written - next > ring->size()) {
+    _lost += written - ring->size() - next;
+    next   = written - ring->size();
+  }
+  current = next++;
+  return ring->slot(current);
+}
+
+/// Send request and register reply callback
+bool SmartMSP::request(uint8_t nodeID, uint8_t dataID, uint16_t timeout, void (*callback)(int, int, int, int)) {
+  if(!callback) return false;
+  for(int i=0; i<MSP_MAX_PENDING; i++) {
+    if(_pendingRequests[i].callback) continue;
+    _pendingRequests[i].callback    = callback;
+    _pendingRequests[i].nodeID      = nodeID;
+    _pendingRequests[i].dataID      = dataID;
+    _pendingRequests[i].timeout     = timeout;
+    _pendingRequests[i].startMillis = millis();
+    sendRequast(dataID, nodeID);
+    return true;
+  }
+  return false;
+}
+
+/// Complete pending request by received value
+bool SmartMSP::replyPending(int id, int payload) {
+  uint8_t nodeID = getNodeID();
+  for(int i=0; i<MSP_MAX_PENDING; i++) {
+    if(!_pendingRequests[i].callback) continue;
+    if(_pendingRequests[i].nodeID != nodeID || _pendingRequests[i].dataID != id) continue;
+    void (*callback)(int, int, int, int) = _pendingRequests[i].callback;
+    _pendingRequests[i].callback = nullptr;
+    callback(nodeID, id, payload, REQUEST_OK);
+    return true;
+  }
+  return false;
+}
+
+/// Request timeout expired
+bool SmartMSP::requestsDue() {
+  for(int i=0; i<MSP_MAX_PENDING; i++) {
+    if(!_pendingRequests[i].callback) continue;
+    if(millis() - _pendingRequests[i].startMillis >= _pendingRequests[i].timeout) return true;
+  }
+  return false;
+}
+
+/// Expire pending requests
+void SmartMSP::expireRequests() {
+  for(int i=0; i<MSP_MAX_PENDING; i++) {
+    if(!_pendingRequests[i].callback) continue;
+    if(millis() - _pendingRequests[i].startMillis < _pendingRequests[i].timeout) continue;
+    void (*callback)(int, int, int, int) = _pendingRequests[i].callback;
+    _pendingRequests[i].callback = nullptr;
+    callback(_pendingRequests[i].nodeID, _pendingRequests[i].dataID, 0, REQUEST_TIMEOUT);
+  }
+}
+
+/// Replay next capture record, return false at end of capture
+bool SmartReplay::handle() {
+  if(!_size) {
+    uint8_t header[CAPTURE_HEADER_SIZE];
+    if(capture->available() < CAPTURE_HEADER_SIZE) return false;
+    capture->readBytes(header, CAPTURE_HEADER_SIZE);
+    _size      = header[0];
+    _direction = header[1];
+    _micros    = (uint32_t)header[2]       | ((uint32_t)header[3] << 8) |
+                 ((uint32_t)header[4] << 16) | ((uint32_t)header[5] << 24);
+    if(capture->readBytes(_buffer, _size) != _size) {
+      _size = 0;
+      return false;
+    }
+    if(!_records++) _dueMicros = micros();
+  }
+  uint32_t now = micros();
+  if(_realtime && (now - _dueMicros < _micros)) return true;
+  _dueMicros += _micros;
+  if(_direction == CAPTURE_RX) {
+    port->inject(_buffer, _size);
+    _bytes += _size;
+  }
+  _size = 0;
+  return true;
+}
+
+/// Queue byte to be driven on the bus
+size_t SmartBusPort::write(uint8_t data) {
+  if(txCount >= MSP_BUS_BUFFER_SIZE) {
+    _overflows++;
+    return 0;
+  }
+  if(!frameOpen) {
+    frameOpen = true;
+    // FIFO is full: no start time, latency of this frame is not counted
+    if((uint8_t)(frameHead - frameTail) < MSP_BUS_FRAME_FIFO) {
+      uint8_t entry = frameHead & (MSP_BUS_FRAME_FIFO - 1);
+      frameMicros[entry] = micros();
+      frameValid |= 1 << entry;
+    }
+    frameHead++;
+  }
+  if(data == '\n') frameOpen = false;
+  tx[txHead] = data;
+  txHead = (txHead + 1) & (MSP_BUS_BUFFER_SIZE - 1);
+  txCount++;
+  return 1;
+}
+
+/// Last byte of frame is sent: start time of the frame, false if unknown
+bool SmartBusPort::frameDone(uint32_t& start) {
+  if(frameTail == frameHead) return false;
+  uint8_t entry = frameTail & (MSP_BUS_FRAME_FIFO - 1);
+  bool    valid = frameValid & (1 << entry);
+  frameValid &= ~(1 << entry);
+  frameTail++;
+  start = frameMicros[entry];
+  return valid;
+}
+
+/// Read byte received from the bus
+int SmartBusPort::read() {
+  if(!rxCount) return -1;
+  uint8_t data = rx[rxTail];
+  rxTail = (rxTail + 1) & (MSP_BUS_BUFFER_SIZE - 1);
+  rxCount--;
+  return data;
+}
+
+SmartBus::SmartBus(SmartBusPort* _ports, uint8_t _count, uint32_t baud) :
+  ports(_ports), count(_count)
+{
+  setBaud(baud);
+  resetStats();
+}
+
+/// Clear statistics
+void SmartBus::resetStats() {
+  lastMicros = startMicros = micros();
+  _bytes = _frames = _collisions = _bitErrors = latencySum = latencyCount = _maxLatency = 0;
+}
+
+/// Bytes per second delivered since resetStats()
+uint32_t SmartBus::throughput() {
+  uint32_t elapsed = micros() - startMicros;
+  return elapsed ? (uint64_t)_bytes * 1000000 / elapsed : 0;
+}
+
+/// Put byte to receivers of all ports except driver
+void SmartBus::deliver(uint8_t from, uint8_t data) {
+  for(uint8_t i=0; i<count; i++) {
+    if(i == from) continue;
+    SmartBusPort& port = ports[i];
+    if(port.rxCount >= MSP_BUS_BUFFER_SIZE) {
+      port._overflows++;
+      continue;
+    }
+    port.rx[port.rxHead] = data;
+    port.rxHead = (port.rxHead + 1) & (MSP_BUS_BUFFER_SIZE - 1);
+    port.rxCount++;
+  }
+}
+
+/// Simulate byte slots elapsed since last update
+void SmartBus::update() {
+  uint32_t now   = micros();
+  if(idle) {
+    // idle line: first byte starts when its frame is written, not in a past slot
+    bool     pending = false;
+    uint32_t first   = now;
+    for(uint8_t i=0; i<count; i++) {
+      uint32_t start;
+      if(!ports[i].txCount) continue;
+      pending = true;
+      if(ports[i].frameStart(start) && now - start > now - first) first = start;
+    }
+    if(!pending) return;
+    lastMicros = first;
+    lastTenths = 0;
+    idle       = false;
+  }
+  uint32_t elapsed = now - lastMicros;
+  if(elapsed > MSP_BUS_MAX_SLOTS * byteTenths / 10) {
+    elapsed    = MSP_BUS_MAX_SLOTS * byteTenths / 10;
+    lastMicros = now - elapsed;
+    lastTenths = 0;
+  }
+  uint32_t slots = elapsed * 10 >= lastTenths ? (elapsed * 10 - lastTenths) / byteTenths : 0;
+  while(slots--) {
+    // end of this slot
+    lastTenths += byteTenths % 10;
+    lastMicros += byteTenths / 10 + lastTenths / 10;
+    lastTenths %= 10;
+    uint8_t  drivers = 0; // enabled drivers
+    uint8_t  senders = 0; // enabled drivers with byte to send
+    uint8_t  driver  = 0;
+    uint8_t  line    = 0xFF;
+    uint32_t start   = 0;
+    bool     timed   = false;
+    bool     busy    = false;
+    for(uint8_t i=0; i<count; i++) {
+      SmartBusPort& port = ports[i];
+      bool enabled = port.isDriving();
+      if(port.txCount) {
+        busy = true;
+        uint8_t data = port.tx[port.txTail];
+        port.txTail = (port.txTail + 1) & (MSP_BUS_BUFFER_SIZE - 1);
+        port.txCount--;
+        if(data == '\n') timed = port.frameDone(start);
+        if(!enabled) {
+          port._undriven++; // UART shifts the byte out, line does not get it
+          continue;
+        }
+        line &= data; // dominant zero bits
+        driver = i;
+        senders++;
+      }
+      if(enabled) drivers++;
+    }
+    if(!busy) {
+      idle = true;
+      break;
+    }
+    if(!senders) continue;
+    if(drivers > 1) {
+      // idle enabled driver fights the sender: undefined levels
+      if(senders < drivers) line &= (uint8_t)random(256);
+      _collisions++;
+      deliver(0xFF, line);
+      continue;
+    }
+    if(bitErrorRate) {
+      for(uint8_t bit=0; bit<8; bit++) {
+        if((uint32_t)random(1000000) < bitErrorRate) {
+          line ^= 1 << bit;
+          _bitErrors++;
+        }
+      }
+    }
+    deliver(driver, line);
+    _bytes++;
+    if(line == '\n') {
+      _frames++;
+      if(!timed) continue;
+      uint32_t latency = lastMicros - start;
+      latencySum += latency;
+      latencyCount++;
+      if(latency > _maxLatency) _maxLatency = latency;
+    }
+  }
+}
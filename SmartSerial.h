@@ -39,6 +39,27 @@
  *    - Add CompositeSerial support (COMPOSITE_SERIAL_SUPPORT)
  *    - Fix debug() with 4 args
  * ------------------------------------------------------------------------
+ *   SmartSerial v1.3 :
+ *    - Add TX queue: queueData()/queueCommand() may be called
+ *      from several producers (ISR, RTOS tasks), frames are sent by handle();
+ *      on cores without byte CAS (Cortex-M0) it is ISR/single-core safe only
+ *    - Add asynchronous request(): reply or timeout is reported to callback
+ *    - Add SmartFrameRing: journal of decoded frames for several readers
+ *    - Add capture of RX/TX traffic and SmartReplay to feed it back
+ *    - Add reliable delivery sendReliable(): sliding window, selective ACK,
+ *      adaptive retransmission timeout (RELIABLE_SUPPORT)
+ *    - Add typed values sendValue()/sendValues(): int8..int64, float, double
+ *      and arrays, byte order is negotiated by negotiateEndian()
+ *    - Add link handshake startLink(): capabilities exchange and baud rate
+ *      upgrade with verification and fallback
+ *    - Add SmartSSP(Stream*) and SmartBus: simulated RS485 bus of virtual
+ *      ports with baud timing, collisions and bit errors
+ *    - Add ping()/time sync: per node RTT statistics, clock offset & drift,
+ *      sendStamped() arrays are received in local time
+ *    - Add event-driven receive: onReceive() from RX interrupt or DMA
+ *      callback, dispatch() runs callbacks instead of handle()
+ *      (EVENT_RECEIVE_SUPPORT)
+ * ------------------------------------------------------------------------
  */
 
 #ifndef _SMART_SERIAL_H_
@@ -56,6 +77,12 @@
 //#define COMPOSITE_SERIAL_SUPPORT
 #endif
 
+// sendReliable() buffers, comment to save RAM
+#define RELIABLE_SUPPORT
+
+// onReceive()/dispatch() RX ring, uncomment for interrupt or DMA receive
+//#define EVENT_RECEIVE_SUPPORT
+
 #ifdef COMPOSITE_SERIAL_SUPPORT
 #include <USBComposite.h>
 #endif
@@ -85,6 +112,13 @@
 #define TYPE_VALUE         0x04
 #define TYPE_REQUEST       0x05
 #define TYPE_ERROR         0x07
+#define TYPE_RELIABLE      0x08
+#define TYPE_ACK           0x09
+#define TYPE_TYPED         0x0A
+#define TYPE_ENDIAN        0x0B
+#define TYPE_LINK          0x0C
+#define TYPE_TIME          0x0D
+#define TYPE_STAMPED       0x0E
 #define TYPE_RESET         0x1F
 
 #ifndef nullptr
@@ -93,6 +127,155 @@
 
 #define MSP_INPUT_BUFFER_SIZE    256
 
+#ifdef EVENT_RECEIVE_SUPPORT
+// RX ring of event-driven mode (must be a power of two, holds a full frame)
+#ifndef MSP_RX_RING_SIZE
+#define MSP_RX_RING_SIZE         512
+#endif
+#if (MSP_RX_RING_SIZE & (MSP_RX_RING_SIZE - 1)) || (MSP_RX_RING_SIZE > 32768)
+#error "MSP_RX_RING_SIZE must be a power of two not greater than 32768"
+#endif
+#if (MSP_RX_RING_SIZE < MSP_INPUT_BUFFER_SIZE + 16)
+#error "MSP_RX_RING_SIZE must hold a full frame (MSP_INPUT_BUFFER_SIZE + 16)"
+#endif
+#define MSP_RX_RING_HIGH         (MSP_RX_RING_SIZE - MSP_RX_RING_SIZE / 4) // dispatch before full
+// arrival times of frames waiting in RX ring (power of two)
+#ifndef MSP_RX_STAMPS
+#define MSP_RX_STAMPS              8
+#endif
+#if (MSP_RX_STAMPS & (MSP_RX_STAMPS - 1)) || (MSP_RX_STAMPS > 128)
+#error "MSP_RX_STAMPS must be a power of two not greater than 128"
+#endif
+#endif
+
+// TX queue (must be a power of two, max 128)
+#ifndef MSP_TX_QUEUE_SIZE
+#define MSP_TX_QUEUE_SIZE          4
+#endif
+#ifndef MSP_TX_QUEUE_PAYLOAD_SIZE
+#define MSP_TX_QUEUE_PAYLOAD_SIZE 32
+#endif
+#if (MSP_TX_QUEUE_SIZE & (MSP_TX_QUEUE_SIZE - 1)) || (MSP_TX_QUEUE_SIZE > 128)
+#error "MSP_TX_QUEUE_SIZE must be a power of two not greater than 128"
+#endif
+
+// requests waiting for reply
+#ifndef MSP_MAX_PENDING
+#define MSP_MAX_PENDING            4
+#endif
+
+// request status
+#define REQUEST_OK                 0
+#define REQUEST_TIMEOUT            1
+
+// payload bytes kept by SmartFrameRing
+#ifndef MSP_RING_PAYLOAD_SIZE
+#define MSP_RING_PAYLOAD_SIZE     32
+#endif
+
+// reliable delivery (window must be a power of two, max 8)
+#ifndef MSP_ARQ_WINDOW
+#define MSP_ARQ_WINDOW             4
+#endif
+#ifndef MSP_ARQ_PAYLOAD_SIZE
+#define MSP_ARQ_PAYLOAD_SIZE      32
+#endif
+#if (MSP_ARQ_WINDOW & (MSP_ARQ_WINDOW - 1)) || (MSP_ARQ_WINDOW > 8)
+#error "MSP_ARQ_WINDOW must be a power of two not greater than 8"
+#endif
+#define MSP_ARQ_INITIAL_RTO   100000 // us
+#define MSP_ARQ_MIN_RTO         5000 // us
+#define MSP_ARQ_MAX_RTO      2000000 // us
+
+// typed values: payload [code | order][values...]
+#define VALUE_INT8         0x01
+#define VALUE_UINT8        0x02
+#define VALUE_INT16        0x03
+#define VALUE_UINT16       0x04
+#define VALUE_INT32        0x05
+#define VALUE_UINT32       0x06
+#define VALUE_INT64        0x07
+#define VALUE_UINT64       0x08
+#define VALUE_FLOAT        0x09
+#define VALUE_DOUBLE       0x0A
+#define VALUE_BIG_ENDIAN   0x80
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define NATIVE_ORDER       VALUE_BIG_ENDIAN
+#else
+#define NATIVE_ORDER       0x00
+#endif
+
+// TYPE_ENDIAN commandID
+#define ENDIAN_ANNOUNCE    0x00
+#define ENDIAN_REPLY       0x01
+
+// TYPE_LINK commandID
+#define LINK_HELLO         0x00
+#define LINK_HELLO_REPLY   0x01
+#define LINK_SWITCH        0x02
+#define LINK_SWITCH_ACK    0x03
+#define LINK_VERIFY        0x04
+#define LINK_VERIFY_ACK    0x05
+#define LINK_CONFIRM       0x06
+
+// link state
+#define LINK_IDLE          0x00
+#define LINK_HELLO_SENT    0x01
+#define LINK_SWITCH_SENT   0x02
+#define LINK_VERIFY_SENT   0x03
+#define LINK_WAIT_VERIFY   0x04
+#define LINK_READY         0x05
+#define LINK_WAIT_CONFIRM  0x06
+
+// link capabilities
+#define LINK_VERSION       0x01
+#define LINK_FRAMING_HEX   0x01 // "[MSP]T..Q..\r\n" ASCII frames
+#define LINK_CHECKSUM_XOR  0x01 // xor parity
+#define LINK_MAX_FRAME     ((MSP_INPUT_BUFFER_SIZE - 16) / 2)
+#define LINK_CAPS_SIZE     9
+
+#ifndef MSP_LINK_TIMEOUT
+#define MSP_LINK_TIMEOUT          200 // ms
+#endif
+#define MSP_LINK_RETRIES            3
+
+// TYPE_TIME commandID
+#define TIME_PING          0x00
+#define TIME_PONG          0x01
+
+// nodes with time statistics
+#ifndef MSP_MAX_TIME_NODES
+#define MSP_MAX_TIME_NODES         4
+#endif
+
+// SmartBusPort RX/TX buffers (power of two, one frame of LINK_MAX_FRAME fits)
+#ifndef MSP_BUS_BUFFER_SIZE
+#define MSP_BUS_BUFFER_SIZE      512
+#endif
+#if (MSP_BUS_BUFFER_SIZE & (MSP_BUS_BUFFER_SIZE - 1)) || (MSP_BUS_BUFFER_SIZE > 32768)
+#error "MSP_BUS_BUFFER_SIZE must be a power of two not greater than 32768"
+#endif
+// start times of frames waiting in SmartBusPort TX buffer (power of two, max 8)
+#ifndef MSP_BUS_FRAME_FIFO
+#define MSP_BUS_FRAME_FIFO         4
+#endif
+#if (MSP_BUS_FRAME_FIFO & (MSP_BUS_FRAME_FIFO - 1)) || (MSP_BUS_FRAME_FIFO > 8)
+#error "MSP_BUS_FRAME_FIFO must be a power of two not greater than 8"
+#endif
+#define MSP_BUS_MAX_SLOTS         64 // bytes simulated per update()
+
+// capture
+#ifndef MSP_CAPTURE_CHUNK
+#define MSP_CAPTURE_CHUNK         64
+#endif
+#if (MSP_CAPTURE_CHUNK < 1) || (MSP_CAPTURE_CHUNK > 255)
+#error "MSP_CAPTURE_CHUNK must be from 1 to 255 (size byte of capture record)"
+#endif
+#define CAPTURE_HEADER_SIZE        6
+#define CAPTURE_RX              0x00
+#define CAPTURE_TX              0x01
+
 #ifndef SERIAL_USB
 struct USBSerial {
 	template<typename... ARGS> void begin(ARGS...) {}
@@ -104,6 +287,120 @@ struct USBSerial {
 };
 #endif
 
+// long double is 8, 12 or 16 bytes depending on the core: not a typed value
+template < typename T > struct smartLongDouble              { static const bool value = false; };
+template <>              struct smartLongDouble<long double> { static const bool value = true;  };
+
+// T keeps 0.5 and -1 (bool keeps 0.5 as true, but not -1 < 0)
+template < typename T >
+constexpr bool smartFloating() { return T(0.5) != T(0) && T(-1) < T(0); }
+
+// Typed value code of T
+template < typename T >
+constexpr uint8_t smartValueType() {
+  static_assert(sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8,
+                "typed values are 1, 2, 4 or 8 bytes");
+  static_assert(!smartLongDouble<T>::value, "long double is not a typed value, use double");
+  static_assert(!smartFloating<T>() || sizeof(T) == 4 || sizeof(T) == 8,
+                "floating values are IEEE single (4 bytes) or double (8 bytes)");
+  return smartFloating<T>() ? (sizeof(T) == 8 ? VALUE_DOUBLE : VALUE_FLOAT) :
+         (T(0) > T(-1))   ? (sizeof(T) == 1 ? VALUE_INT8  : sizeof(T) == 2 ? VALUE_INT16  :
+                             sizeof(T) == 4 ? VALUE_INT32 : VALUE_INT64) :
+                            (sizeof(T) == 1 ? VALUE_UINT8 : sizeof(T) == 2 ? VALUE_UINT16 :
+                             sizeof(T) == 4 ? VALUE_UINT32 : VALUE_UINT64);
+}
+
+// -------------------------------------------
+// SmartLinkTime - RTT & clock of remote node
+// -------------------------------------------
+struct SmartLinkTime {
+  bool     used;
+  uint8_t  nodeID;
+  uint32_t samples;
+  uint32_t rtt;        // us, last, with line time of ping & pong
+  uint32_t rttMin;     // us
+  uint32_t rttMax;     // us
+  uint32_t rttAvg;     // us, moving average
+  int32_t  offset;     // us, node clock - local clock
+  float    drift;      // ppm, node clock rate - local clock rate
+  uint32_t syncMicros; // local time of last offset
+};
+
+// -------------------------------------------
+// SmartFrame - decoded frame record
+// -------------------------------------------
+struct SmartFrame {
+  volatile uint32_t sequence;
+  uint32_t timestamp;                       // micros() when decoded
+  uint8_t  port;                            // see setFrameRing()
+  uint8_t  nodeID;
+  uint8_t  packetType;
+  uint8_t  commandID;
+  uint8_t  datasize;                        // full size of received payload
+  uint8_t  payload[MSP_RING_PAYLOAD_SIZE];  // cut to MSP_RING_PAYLOAD_SIZE
+};
+
+// -------------------------------------------
+// SmartFrameRing - journal of decoded frames
+// one writer (SmartSSP ports), many readers
+// -------------------------------------------
+class SmartFrameRing {
+	
+	private:
+	
+	SmartFrame*       frames;
+	uint16_t          capacity;
+	volatile uint32_t _written = 0;
+	
+	public:
+	
+	// size below 2 is rejected (ring stays empty): the rewrite marker of
+	// a single record would equal the sequence its reader holds
+	SmartFrameRing(SmartFrame* buffer, uint16_t size) : frames(buffer), capacity(size < 2 ? 0 : size) {}
+	template < uint16_t N >
+	SmartFrameRing(SmartFrame (&buffer)[N]) : frames(buffer), capacity(N) {
+	  static_assert(N >= 2, "SmartFrameRing needs at least 2 frames");
+	}
+	
+	void publish(uint8_t port, uint8_t nodeID, uint8_t packetType, uint8_t commandID,
+	             const uint8_t* payload, uint8_t datasize);
+	
+	uint32_t written() { return __atomic_load_n(&_written, __ATOMIC_ACQUIRE); }
+	uint16_t size()    { return capacity; }
+	SmartFrame* slot(uint32_t sequence) { return &frames[sequence % capacity]; }
+	
+};
+
+// -------------------------------------------
+// SmartFrameReader - reads ring at own pace
+// -------------------------------------------
+class SmartFrameReader {
+	
+	private:
+	
+	SmartFrameRing* ring;
+	uint32_t        next;
+	uint32_t        current  = 0;
+	uint32_t        _lost    = 0;
+	
+	public:
+	
+	SmartFrameReader(SmartFrameRing* _ring) : ring(_ring), next(_ring->written()) {}
+	
+	// Next frame or nullptr. Frame is not copied: check overrun() after use
+	const SmartFrame* read();
+	// Last frame returned by read() was overwritten by writer
+	bool overrun() {
+	  __atomic_thread_fence(__ATOMIC_ACQUIRE); // copied fields are read before the check
+	  return ring->slot(current)->sequence != current;
+	}
+	// Frames skipped because the reader was too slow
+	uint32_t lost() { return _lost; }
+	
+};
+
+class SmartBusPort;
+
 // -------------------------------------------
 // SmartSSP - Smart Serial Protocol
 // -------------------------------------------
@@ -122,8 +419,26 @@ class SmartSSP {
 	
 	Stream* serial;
 		
+    bool    receive(char inChar, uint32_t arrival);
+    void    service();
+    bool    serviceDue();
     bool    parseData();
     void    processData();
+    void    typedReceive();
+    void    endianReceive();
+    uint32_t frameMicros(uint8_t datasize);
+    uint8_t maxPayload();
+    void    timeReceive();
+    void    stampedReceive();
+    void    linkReceive();
+    void    linkHandle();
+    bool    linkDue();
+    void    linkSend(uint8_t command, const uint8_t* payload, uint8_t size);
+    void    linkSendBaud(uint8_t command, uint32_t baud);
+    void    linkSendCaps(uint8_t command);
+    void    linkPropose(uint32_t below);
+    bool    linkLeads();
+    void    setBaud(uint32_t baud);
     void    sendPacket();
 	void    printHexPayload();
     void    printInfo();
@@ -145,9 +460,25 @@ class SmartSSP {
 	  uint8_t* payload = nullptr;
     } inPacket, outPacket;
     
+    // Frame encoded by producer and waiting for handle()
+    struct QueuedPacket {
+      volatile uint8_t ready = false;
+      uint8_t  packetType;
+      uint8_t  commandID;
+      uint8_t  datasize;
+      uint8_t  payload[MSP_TX_QUEUE_PAYLOAD_SIZE];
+    } _txQueue[MSP_TX_QUEUE_SIZE];
+    volatile uint8_t _txHead = 0;
+    volatile uint8_t _txTail = 0;
+    
+    QueuedPacket* reserveQueued();
+    void    commitQueued(QueuedPacket* slot);
+    void    flushQueue();
+    
 	int      _pinTX = PIN_UNCONNECTED;
+	SmartBusPort* _busPort          = nullptr; // driver enable of simulated bus
     char     _inputChar[MSP_INPUT_BUFFER_SIZE];
-    uint8_t  _inCounter;
+    uint16_t _inCounter;
     uint8_t  _checkedParity;
     String   _checkMSP              = "";
     bool     _ready                 = false;
@@ -160,27 +491,122 @@ class SmartSSP {
 	uint32_t _answerTimeoutMicros   = false;
     bool     _errorUsage            = true;
 	uint8_t  _isDebug               = false;
+	uint8_t  _portID                = 0;
+	SmartFrameRing* _frameRing      = nullptr;
+	uint8_t  _processDataFlag       = false;
+	volatile uint32_t _rxMicros     = 0; // last char received
+	uint32_t _rxFrameMicros         = 0; // end of frame being parsed
+	
+	#ifdef EVENT_RECEIVE_SUPPORT
+	// event-driven receive: written by interrupt, read by dispatch()
+	uint8_t           _rxRing[MSP_RX_RING_SIZE];
+	volatile uint16_t _rxRingHead       = 0;
+	volatile uint16_t _rxRingTail       = 0;
+	volatile uint8_t  _rxFrames         = 0;
+	uint8_t           _rxDispatched     = 0;
+	uint32_t          _rxStamps[MSP_RX_STAMPS]; // '\n' arrival by frame
+	volatile uint32_t _rxOverflows      = 0;
+	void            (*_onFrame)()       = nullptr;
+	#endif
+	SmartLinkTime _linkTime[MSP_MAX_TIME_NODES];
+	
+	// no RX for 2 chars: half-duplex line may be driven
+	bool lineIdle() {
+		return micros() - _rxMicros >= 20000000UL / _baud;
+	}
+	uint8_t  _wireOrder             = VALUE_BIG_ENDIAN; // until peer is known
+	
+	uint8_t  _linkState             = LINK_IDLE;
+	uint8_t  _linkPeer              = 0; // nodeID of HELLO the handshake runs with
+	uint8_t  _linkRetries           = 0;
+	uint32_t _linkMillis            = 0;
+	uint32_t _linkTarget            = 0;
+	uint32_t _linkFallback          = 0;
+	uint32_t _maxBaud               = 0; // 0 - keep begin() baud
+	uint32_t _peerMaxBaud           = 0;
+	uint8_t  _peerMaxFrame          = 0;
+	uint8_t  _linkNonce             = 0; // tie-break of equal nodeIDs
+	
+	Print*   _capture               = nullptr;
+	uint8_t  _capBuffer[MSP_CAPTURE_CHUNK];
+	uint8_t  _capSize               = 0;
+	uint8_t  _capDirection          = CAPTURE_RX;
+	uint32_t _capMicros             = 0; // start of record
+	uint32_t _capLastMicros         = 0; // start of previous record
+	
+	void     captureByte(uint8_t direction, char data, uint32_t stamp);
+	void     captureField(char tag, uint8_t data, uint32_t stamp);
+	void     captureFrame();
+	void     captureFlush();
+	
+	#ifdef RELIABLE_SUPPORT
+	struct ArqFrame {
+	  bool     used;
+	  bool     sent;
+	  bool     acked;
+	  bool     retransmitted;
+	  uint8_t  sequence;
+	  uint8_t  commandID;
+	  uint8_t  datasize;
+	  uint32_t sentMicros;
+	  uint8_t  payload[MSP_ARQ_PAYLOAD_SIZE];
+	} _arqTx[MSP_ARQ_WINDOW], _arqRx[MSP_ARQ_WINDOW];
+	uint8_t  _arqWindow             = MSP_ARQ_WINDOW;
+	uint8_t  _arqBase               = 0; // oldest not acknowledged
+	uint8_t  _arqNext               = 0; // next to send
+	uint8_t  _arqExpected           = 0; // next to deliver
+	uint8_t  _arqPeer               = 0; // the only node frames go to and come from
+	uint32_t _arqSRTT               = 0;
+	uint32_t _arqRTTVAR             = 0;
+	uint32_t _arqRTO                = MSP_ARQ_INITIAL_RTO;
+	uint32_t _arqRetransmits        = 0;
+	uint32_t _arqCorrupted          = 0;
+	bool     _arqAckPending         = false;
+	bool     _arqActive             = false; // reliable traffic seen
+	
+	bool     arqSend(uint8_t dataID, const uint8_t* data, uint8_t length, uint8_t nodeID);
+	void     arqTransmit(ArqFrame& frame);
+	void     arqSendAck();
+	void     arqReceive();
+	void     arqAcknowledge();
+	void     arqSample(uint32_t rtt);
+	void     arqHandle();
+	bool     arqDue();
+	uint16_t arqCrc(uint8_t nodeID, uint8_t commandID, const uint8_t* data, uint8_t length);
+	bool     arqCheck();
+	bool     arqActive() { return _arqActive; }
+	#else
+	bool     arqActive() { return false; }
+	#endif
 			
 	virtual void request(int) {}
 	virtual void value(int, int) {}
 	virtual void array(int, uint8_t*, int) {}
 	virtual void event(int, int) {}
+	virtual void typed(int, uint8_t, void*, int) {}
+	virtual void stamped(int, uint8_t*, int, uint32_t) {}
 	virtual void error() {}
 	virtual void reset() {}
 	virtual void handler() {}
+	virtual bool handlerDue() { return false; } // handler() has work for pending()
+	// request() timeouts of SmartMSP, handler() is left to user subclasses
+	virtual void expireRequests() {}
+	virtual bool requestsDue() { return false; }
+	
+	void driveTX(bool state);
 	
 	void enableTX() {
-		if(_pinTX != PIN_UNCONNECTED) {
-			digitalWrite(_pinTX, _txEnabled=HIGH);
-			uint16_t outDataSize = (outPacket.datasize*2) + strlen(TAG_MSP) + 20;
-			uint16_t packetMicros = (10000000 / _baud) * outDataSize;
+		if(_pinTX != PIN_UNCONNECTED || _busPort) {
+			driveTX(_txEnabled=HIGH);
+			// driver is released right after the frame: peer may answer at once
+			uint32_t packetMicros = frameMicros(outPacket.datasize);
                         if(micros()<_txMicros) _txMicros += packetMicros;
                         else _txMicros = micros() + packetMicros;
 		}
 	}
 	
 	void disableTX() {
-		if(_pinTX != PIN_UNCONNECTED) digitalWrite(_pinTX, _txEnabled=LOW);
+		if(_pinTX != PIN_UNCONNECTED || _busPort) driveTX(_txEnabled=LOW);
 	}
 	
     void sendError() {
@@ -197,6 +623,9 @@ class SmartSSP {
   public:
   
     SmartSSP(HardwareSerial* _serial, int pinTXen = PIN_UNCONNECTED);
+    SmartSSP(Stream* _serial, int pinTXen = PIN_UNCONNECTED);
+    // SmartBus port: enableTX() and disableTX() switch its driver
+    SmartSSP(SmartBusPort* _serial, int pinTXen = PIN_UNCONNECTED);
     #ifdef _VARIANT_ARDUINO_STM32_
       SmartSSP(USBSerial*    _serial);
 	  #ifdef COMPOSITE_SERIAL_SUPPORT
@@ -209,11 +638,28 @@ class SmartSSP {
     void     begin();
     void     begin(long baud, uint8_t nodeID = 0);
     bool     handle();
+	void     inject(const uint8_t* data, uint16_t size);
+	
+	// --- Event-driven receive (instead of handle()):
+	// --- onReceive() is called from RX interrupt, serialEvent() or DMA
+	// --- callback, dispatch() from loop when pending()
+	#ifdef EVENT_RECEIVE_SUPPORT
+	void     onReceive(uint8_t data);
+	void     onReceive(const uint8_t* data, uint16_t size);
+	bool     dispatch();
+	// Frame received, RX ring nearly full, TX queued or protocol timer due
+	bool     pending();
+	uint32_t rxOverflows() { return _rxOverflows; }
+	// Called from onReceive() context at end of frame and when RX ring is nearly full
+	void     setFrameNotify(void (*function)()) { _onFrame = function; }
+	#endif
+	void     setCapture(Print* capture);
 	void     setCallbackTimeout(uint16_t _timeout);
 	void     setAnswerTimeout(uint16_t _timeout);
 	    
     bool     available();
     uint8_t  getDataID();
+    uint8_t  getNodeID();
     uint8_t  getCommandID();
     uint8_t  getPacketType();
     uint8_t  getSize();
@@ -224,9 +670,26 @@ class SmartSSP {
 		return _txEnabled;
 	}
 	
+	// --- Link handshake: exchange capabilities, then step both sides up to
+	// --- the fastest common baud rate (verified, falls back on failure).
+	// --- Point-to-point: the first node answering (or sending) LINK_HELLO
+	// --- is the peer, link frames of other nodes are ignored until READY.
+	// --- Not for multi-drop buses, all their nodes share one baud rate.
+	void     setMaxBaud(uint32_t baud) { _maxBaud = baud; }
+	void     startLink();
+	uint8_t  linkState()   { return _linkState; }
+	uint32_t getBaud()     { return _baud; }
+	uint8_t  peerMaxFrame() { return _peerMaxFrame; }
+	
 	void setErrorUsage(uint8_t _state) {
 		_errorUsage = _state;
 	}
+	
+	// Publish every decoded frame to ring (nullptr - disable)
+	void setFrameRing(SmartFrameRing* ring, uint8_t portID = 0) {
+		_frameRing = ring;
+		_portID    = portID;
+	}
     
     template < typename T >
     void sendData(uint8_t  dataID, T dataArray, uint8_t length) {
@@ -269,6 +732,132 @@ class SmartSSP {
       sendPacket();
     }
 	
+    #ifdef RELIABLE_SUPPORT
+    // --- Reliable delivery: frame is kept until acknowledged by peer and
+    // --- retransmitted on loss. Peer gets it with array() callback in order.
+    // --- Frames and ACKs are sent only when the line is idle (RS485)
+    // --- and carry CRC16. Error frames are not sent while it is used.
+    // --- Point-to-point: the first peer (nodeID of first sendReliable()
+    // --- or sender of first frame received) is kept, frames of and
+    // --- for other nodes are ignored. Without nodeID frames go to that
+    // --- peer, node 0 before it is known.
+    // --- Return false if window is full, length > MSP_ARQ_PAYLOAD_SIZE
+    // --- or nodeID is not the peer.
+    template < typename T >
+    bool sendReliable(uint8_t dataID, T dataArray, uint8_t length) {
+      return arqSend(dataID, (const uint8_t*)dataArray, length, _arqPeer);
+    }
+    template < typename T >
+    bool sendReliable(uint8_t dataID, T dataArray, uint8_t length, uint8_t nodeID) {
+      return arqSend(dataID, (const uint8_t*)dataArray, length, nodeID);
+    }
+    
+    // Frames in flight limit: 1 .. MSP_ARQ_WINDOW
+    void setReliableWindow(uint8_t window) {
+      _arqWindow = constrain(window, 1, MSP_ARQ_WINDOW);
+    }
+    
+    uint8_t  reliablePeer()        { return _arqPeer; }
+    uint8_t  reliablePending()     { return _arqNext - _arqBase; }
+    uint32_t reliableRTO()         { return _arqRTO; }
+    uint32_t reliableRetransmits() { return _arqRetransmits; }
+    uint32_t reliableCorrupted()   { return _arqCorrupted; }
+    #endif
+    
+    // --- Time sync: ping() measures RTT and clock offset of nodeID,
+    // --- answer is processed by handle()
+    void ping(uint8_t nodeID);
+    SmartLinkTime* linkTime(uint8_t nodeID);
+    uint32_t nodeToLocal(uint8_t nodeID, uint32_t nodeMicros);
+    
+    // --- Array with micros() of sender: receiver gets it in local time.
+    // --- Return false if array and stamp do not fit to one frame
+    template < typename T >
+    bool sendStamped(uint8_t dataID, T dataArray, uint8_t length) {
+      if(length + 4 > maxPayload()) return false;
+      uint32_t stamp = micros();
+      if(outPacket.payload) delete[] outPacket.payload;
+      outPacket.packetType = TYPE_STAMPED;
+      outPacket.commandID  = dataID;
+      outPacket.datasize   = length + 4;
+      outPacket.payload    = new uint8_t[length + 4];
+      outPacket.payload[0] = stamp >> 24;
+      outPacket.payload[1] = stamp >> 16;
+      outPacket.payload[2] = stamp >> 8;
+      outPacket.payload[3] = stamp >> 0;
+      for(int i=0 ; i<length ; i++) {
+        outPacket.payload[i+4] = ((uint8_t*)dataArray)[i];
+      }
+      sendPacket();
+      return true;
+    }
+    
+    // --- ISR/task safe variants: frame is copied to the TX queue and
+    // --- written to the port by next handle(). Return false if full.
+    // --- Lock-free where the core has byte CAS, otherwise interrupts are
+    // --- disabled for a few cycles (ISR/single-core safe only).
+    template < typename T >
+    bool queueData(uint8_t dataID, T dataArray, uint8_t length) {
+      if(length > MSP_TX_QUEUE_PAYLOAD_SIZE) return false;
+      QueuedPacket* slot = reserveQueued();
+      if(!slot) return false;
+      slot->packetType = TYPE_ARRAY;
+      slot->commandID  = dataID;
+      slot->datasize   = length;
+      for(int i=0 ; i<length ; i++) {
+        slot->payload[i] = ((uint8_t*)dataArray)[i];
+      }
+      commitQueued(slot);
+      return true;
+    }
+    
+    template < typename T >
+    bool queueData(uint8_t dataID, T payload) {
+      QueuedPacket* slot = reserveQueued();
+      if(!slot) return false;
+      slot->packetType = TYPE_VALUE;
+      slot->commandID  = dataID;
+      slot->datasize   = 4;
+      slot->payload[0] = payload >> 24;
+      slot->payload[1] = payload >> 16;
+      slot->payload[2] = payload >> 8;
+      slot->payload[3] = payload >> 0;
+      commitQueued(slot);
+      return true;
+    }
+    
+    template < typename T >
+    bool queueCommand(uint8_t dataID, T payload) {
+      QueuedPacket* slot = reserveQueued();
+      if(!slot) return false;
+      slot->packetType = TYPE_EVENT;
+      slot->commandID  = dataID;
+      slot->datasize   = 4;
+      slot->payload[0] = payload >> 24;
+      slot->payload[1] = payload >> 16;
+      slot->payload[2] = payload >> 8;
+      slot->payload[3] = payload >> 0;
+      commitQueued(slot);
+      return true;
+    }
+	
+    // --- Typed values: receiver gets native type and byte order
+    // --- Return false if values do not fit to one frame (LINK_MAX_FRAME)
+    template < typename T >
+    bool sendValue(uint8_t dataID, T value) {
+      return sendTyped(dataID, smartValueType<T>(), (const uint8_t*)&value, sizeof(T), 1);
+    }
+    
+    template < typename T >
+    bool sendValues(uint8_t dataID, const T* values, uint8_t count) {
+      return sendTyped(dataID, smartValueType<T>(), (const uint8_t*)values, sizeof(T), count);
+    }
+    
+    bool sendTyped(uint8_t dataID, uint8_t code, const uint8_t* values, uint8_t size, uint8_t count);
+    
+    // Exchange byte order with peer: same order values are sent unswapped
+    void negotiateEndian();
+	
 	void sendRequast(uint8_t dataID) {
 	  if(outPacket.payload) delete[] outPacket.payload;
       outPacket.packetType = TYPE_REQUEST;
@@ -282,6 +871,13 @@ class SmartSSP {
 	  }
 	}
 	
+	void sendRequast(uint8_t dataID, uint8_t nodeID) {
+	  uint8_t ownNodeID = outPacket.nodeID;
+	  outPacket.nodeID  = nodeID;
+	  sendRequast(dataID);
+	  outPacket.nodeID  = ownNodeID;
+	}
+	
 	void sendReset() {
       if(outPacket.payload) delete[] outPacket.payload;
       outPacket.packetType = TYPE_RESET;
@@ -407,11 +1003,26 @@ class SmartMSP : public SmartSSP {
     void (*user_onValue)(int, int) = nullptr;
     void (*user_onError)() = nullptr;
     void (*user_onReset)() = nullptr;
+    void (*user_onTyped)(int, uint8_t, void*, int) = nullptr;
+    void (*user_onStamped)(int, uint8_t*, int, uint32_t) = nullptr;
+	
+	struct PendingRequest {
+	  void (*callback)(int, int, int, int) = nullptr;
+	  uint8_t  nodeID;
+	  uint8_t  dataID;
+	  uint16_t timeout;
+	  uint32_t startMillis;
+	} _pendingRequests[MSP_MAX_PENDING];
+	
+	bool replyPending(int id, int payload);
+	void expireRequests() override;
+	bool requestsDue() override;
 	
 	void request(int id) override {
 		if (user_onRequest) user_onRequest(id);
 	}
 	void value(int id, int payload) override {
+		if (replyPending(id, payload)) return;
 		if (user_onValue) user_onValue(id, payload);
 	}
 	void array(int id, uint8_t* payload, int size) override {
@@ -420,6 +1031,12 @@ class SmartMSP : public SmartSSP {
 	void event(int id, int value) override {
 		if (user_onEvent) user_onEvent(id, value);
 	}
+	void typed(int id, uint8_t code, void* values, int count) override {
+		if (user_onTyped) user_onTyped(id, code, values, count);
+	}
+	void stamped(int id, uint8_t* payload, int size, uint32_t micros) override {
+		if (user_onStamped) user_onStamped(id, payload, size, micros);
+	}
 	void error() override {
 		if (user_onError) user_onError();
 	}
@@ -430,6 +1047,8 @@ class SmartMSP : public SmartSSP {
 	public :
 	
 	SmartMSP(HardwareSerial* _serial, int pinTXen = PIN_UNCONNECTED) : SmartSSP(_serial, pinTXen) {}
+	SmartMSP(Stream* _serial, int pinTXen = PIN_UNCONNECTED) : SmartSSP(_serial, pinTXen) {}
+	SmartMSP(SmartBusPort* _serial, int pinTXen = PIN_UNCONNECTED) : SmartSSP(_serial, pinTXen) {}
     #ifdef _VARIANT_ARDUINO_STM32_
       SmartMSP(USBSerial*       _serial) : SmartSSP(_serial) {}
 	  #ifdef COMPOSITE_SERIAL_SUPPORT
@@ -443,9 +1062,151 @@ class SmartMSP : public SmartSSP {
     void attachValue(void (*function)(int, int)) { user_onValue = function; }
     void attachArray(void (*function)(int, uint8_t*, int)) { user_onArray = function; }
     void attachEvent(void (*function)(int, int)) { user_onEvent = function; }
+    void attachTyped(void (*function)(int, uint8_t, void*, int)) { user_onTyped = function; }
+    void attachStamped(void (*function)(int, uint8_t*, int, uint32_t)) { user_onStamped = function; }
     void attachError(void (*function)()) { user_onError = function; }
     void attachReset(void (*function)()) { user_onReset = function; }
 	
+	// Send request to nodeID and wait for TYPE_VALUE reply without blocking.
+	// callback(nodeID, dataID, value, status) is called from handle() with
+	// REQUEST_OK or REQUEST_TIMEOUT (timeout in ms). Return false if too many
+	// requests are pending.
+	bool request(uint8_t nodeID, uint8_t dataID, uint16_t timeout, void (*callback)(int, int, int, int));
+	
+};
+
+// -------------------------------------------
+// SmartReplay - feeds captured RX traffic
+// back to the port parser
+// -------------------------------------------
+class SmartReplay {
+	
+	private:
+	
+	Stream*   capture;
+	SmartSSP* port;
+	bool      _realtime    = true;
+	uint8_t   _buffer[255];
+	uint8_t   _size        = 0;
+	uint8_t   _direction   = CAPTURE_RX;
+	uint32_t  _micros      = 0; // record delay after previous one
+	uint32_t  _dueMicros   = 0; // replay time of previous record
+	uint32_t  _records     = 0;
+	uint32_t  _bytes       = 0;
+	
+	public:
+	
+	SmartReplay(Stream* _capture, SmartSSP* _port) : capture(_capture), port(_port) {}
+	
+	// true - keep original timing, false - as fast as possible
+	void setRealtime(bool state) { _realtime = state; }
+	
+	// Call from loop() until it returns false (end of capture)
+	bool handle();
+	
+	uint32_t records() { return _records; }
+	uint32_t bytes()   { return _bytes; }
+	
+};
+
+class SmartBus;
+
+// -------------------------------------------
+// SmartBusPort - virtual serial port of
+// SmartBus, pass it to SmartSSP(SmartBusPort*)
+// -------------------------------------------
+class SmartBusPort : public Stream {
+	
+	friend class SmartBus;
+	
+	private:
+	
+	uint8_t  rx[MSP_BUS_BUFFER_SIZE];
+	uint8_t  tx[MSP_BUS_BUFFER_SIZE];
+	uint16_t rxHead      = 0;
+	uint16_t rxTail      = 0;
+	uint16_t txHead      = 0;
+	uint16_t txTail      = 0;
+	uint16_t rxCount     = 0;
+	uint16_t txCount     = 0;
+	bool     frameOpen   = false;
+	bool     enableInput = false; // driver switched by setDriver(), else drives while sending
+	bool     enabled     = false;
+	uint32_t _undriven   = 0;
+	uint32_t frameMicros[MSP_BUS_FRAME_FIFO]; // first byte of frame is written
+	uint8_t  frameValid  = 0;  // bit per FIFO entry, clear if FIFO was full
+	uint8_t  frameHead   = 0;  // frames written
+	uint8_t  frameTail   = 0;  // frames sent to the bus
+	uint32_t _overflows  = 0;
+	
+	bool     frameDone(uint32_t& start);
+	// Write time of frame being sent, false if unknown
+	bool     frameStart(uint32_t& start) {
+	  uint8_t entry = frameTail & (MSP_BUS_FRAME_FIFO - 1);
+	  start = frameMicros[entry];
+	  return frameTail != frameHead && (frameValid & (1 << entry));
+	}
+	
+	public:
+	
+	size_t write(uint8_t data) override;
+	int    available() override { return rxCount; }
+	int    read() override;
+	int    peek() override { return rxCount ? rx[rxTail] : -1; }
+	using  Print::write;
+	
+	// RS485 driver enable (DE pin): bytes sent while it is off are lost,
+	// enabled driver of idle port collides with frames of other ports
+	void     setDriver(bool state) { enableInput = true; enabled = state; }
+	bool     isDriving() { return enableInput ? enabled : txCount; }
+	uint32_t overflows() { return _overflows; }
+	uint32_t undriven()  { return _undriven; } // bytes sent with driver off
+	
+};
+
+// -------------------------------------------
+// SmartBus - half-duplex RS485 bus simulator
+// -------------------------------------------
+class SmartBus {
+	
+	private:
+	
+	SmartBusPort* ports;
+	uint8_t  count;
+	uint32_t byteTenths;     // 0.1 us per byte: no drift against UART timing
+	uint32_t lastMicros;
+	uint8_t  lastTenths = 0; // fraction of lastMicros
+	bool     idle       = true;
+	uint32_t startMicros;
+	uint32_t bitErrorRate = 0; // errors per million bits
+	uint32_t _bytes       = 0;
+	uint32_t _frames      = 0;
+	uint32_t _collisions  = 0;
+	uint32_t _bitErrors   = 0;
+	uint32_t latencySum   = 0;
+	uint32_t latencyCount = 0;
+	uint32_t _maxLatency  = 0;
+	
+	void     deliver(uint8_t from, uint8_t data);
+	
+	public:
+	
+	SmartBus(SmartBusPort* _ports, uint8_t _count, uint32_t baud = DEFAULT_BAUDRATE);
+	
+	void setBaud(uint32_t baud) { byteTenths = max(100000000UL / baud, 1UL); }
+	void setBitErrorRate(uint32_t ppm) { bitErrorRate = ppm; }
+	
+	// Move bytes on the bus up to micros(), call it from loop()
+	void update();
+	void resetStats();
+	
+	uint32_t bytes()          { return _bytes; }      // delivered
+	uint32_t frames()         { return _frames; }     // delivered
+	uint32_t collisions()     { return _collisions; } // byte slots
+	uint32_t bitErrors()      { return _bitErrors; }
+	uint32_t maxLatency()     { return _maxLatency; } // us, write to delivery of frame
+	uint32_t averageLatency() { return latencyCount ? latencySum / latencyCount : 0; }
+	uint32_t throughput();                            // bytes per second
 	
 };
 
@@ -461,6 +1222,42 @@ class SmartMSP : public SmartSSP {
  * "P" - payload     (data)
  * "Q" - parity      (crc)
  * 
+ * Typed values (sendValue, sendValues):
+ * TYPE_TYPED:  I - dataID, P - [VALUE_xxx | VALUE_BIG_ENDIAN][values...]
+ * TYPE_ENDIAN: I - ENDIAN_ANNOUNCE/ENDIAN_REPLY, P - [NATIVE_ORDER]
+ * payload is limited to LINK_MAX_FRAME (or smaller peerMaxFrame())
+ * 
+ * Time sync (ping):
+ * TYPE_TIME: I - TIME_PING, N - pinged node,  P - [pinger][t1]
+ *            I - TIME_PONG, N - answered node, P - [pinger][t1][t2 received][t3 sent]
+ *            other nodes ignore pong with foreign [pinger]
+ * TYPE_STAMPED: I - dataID, P - [sender micros][data...], limited like typed values
+ * times are 4 bytes BE micros()
+ * 
+ * Link handshake (startLink):
+ * TYPE_LINK: I - LINK_xxx
+ *   LINK_HELLO, LINK_HELLO_REPLY: P - [version][max baud, 4 bytes BE]
+ *     [framing modes][checksum types][max frame payload][byte order][nonce]
+ *   N - sender nodeID. If both sides send LINK_HELLO at once, the lower
+ *     nodeID proposes the baud, the lower nonce on equal nodeIDs.
+ *   LINK_SWITCH, LINK_SWITCH_ACK: P - [baud, 4 bytes BE], 0 - rejected
+ *   LINK_VERIFY, LINK_VERIFY_ACK, LINK_CONFIRM: sent at new baud rate,
+ *     responder repeats VERIFY_ACK until LINK_CONFIRM, falls back without it
+ *   one peer: frames of other nodeIDs are ignored during the handshake
+ * 
+ * Reliable frames (sendReliable):
+ * TYPE_RELIABLE: N - receiver, I - dataID, P - [sender][sequence][data...][CRC16]
+ * TYPE_ACK:      N - receiver, I - 0,      P - [sender][next expected sequence][SACK][CRC16]
+ * bit n of SACK - frame (next expected + 1 + n) is received out of order
+ * CRC16 - CCITT (0x1021, init 0xFFFF, BE) of N, I and P before it,
+ * frames with wrong CRC16 are dropped and recovered by retransmission,
+ * frames and ACKs of other nodes are ignored. One sequence space per port:
+ * a node exchanges reliable frames with one peer only
+ * 
+ * Capture record (setCapture):
+ * [size][direction][delay, 4 bytes LE][size bytes of raw traffic]
+ * delay - micros from start of previous record (first: from setCapture),
+ * captures of any length replay, a single gap must be below 71 minutes
  */
 // -------------------------------------------
 
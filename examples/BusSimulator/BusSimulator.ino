@@ -0,0 +1,124 @@
+/* BusSimulator - example show how to test many nodes without hardware.
+ * ------------------------------------------------------------------------
+ * Description:
+ * Master and NODES_COUNT nodes are connected to simulated RS485 bus.
+ * Master polls every node by request() and prints bus statistics:
+ * throughput, frame latency, collisions and bit errors.
+ * Change NODES_COUNT, BUS_BAUDRATE and BIT_ERROR_PPM to see
+ * how the protocol scales. Every node takes about 3 KB of RAM,
+ * so use a board with enough memory (STM32).
+ * ------------------------------------------------------------------------
+ * License:
+ * GNU General Public License v3.0
+ * https://github.com/denisn73/SmartSerial/blob/master/LICENSE
+ * ------------------------------------------------------------------------
+ * Author:
+ * Developed by Denis Silivanov
+ * VK: @silivanov
+ * Instagram: @denisfpv
+ * Copyright (c) Denis Silivanov 2018
+ * https://github.com/denisn73/SmartSerial
+ * ------------------------------------------------------------------------
+ */
+
+#include <SmartSerial.h>   // Smart Serial library
+
+//--------------------------------------------------------------------------------------------
+// *** Simulation Configuration ***
+//--------------------------------------------------------------------------------------------
+
+#define NODES_COUNT              8
+#define BUS_BAUDRATE        115200
+#define BIT_ERROR_PPM            0 // bit errors per million bits
+#define POLL_TIMEOUT_MS         50 // ms
+#define DATA_ID                  1
+
+//--------------------------------------------------------------------------------------------
+// *** Node: answers requests addressed to own nodeID ***
+//--------------------------------------------------------------------------------------------
+class Node : public SmartSSP {
+
+  private:
+
+  uint8_t nodeID;
+
+  void request(int id) override {
+    if(getNodeID() == nodeID) sendData(id, (long)millis());
+  }
+
+  public:
+
+  Node(SmartBusPort* port, uint8_t id) : SmartSSP(port), nodeID(id) {}
+
+};
+
+//--------------------------------------------------------------------------------------------
+// *** Create bus, master and nodes ***
+//--------------------------------------------------------------------------------------------
+SmartBusPort ports[NODES_COUNT + 1];
+SmartBus     bus(ports, NODES_COUNT + 1, BUS_BAUDRATE);
+SmartMSP     master(&ports[NODES_COUNT]);
+Node*        nodes[NODES_COUNT];
+
+uint32_t replies  = 0;
+uint32_t timeouts = 0;
+uint8_t  polled   = 0;
+bool     waiting  = false;
+
+//--------------------------------------------------------------------------------------------
+// *** reply or timeout of master request ***
+//--------------------------------------------------------------------------------------------
+void replyMSP(int node, int id, int value, int status) {
+  if(status == REQUEST_OK) replies++;
+  else timeouts++;
+  waiting = false;
+}
+
+//--------------------------------------------------------------------------------------------
+// *** Setup function ***
+//--------------------------------------------------------------------------------------------
+void setup() {
+
+  Serial.begin(DEFAULT_BAUDRATE);
+
+  master.begin(BUS_BAUDRATE, 0);
+  for(uint8_t i=0; i<NODES_COUNT; i++) {
+    nodes[i] = new Node(&ports[i], i + 1);
+    nodes[i]->begin(BUS_BAUDRATE, i + 1);
+  }
+
+  bus.setBitErrorRate(BIT_ERROR_PPM);
+
+}
+
+//--------------------------------------------------------------------------------------------
+// *** Loop function ***
+//--------------------------------------------------------------------------------------------
+void loop() {
+
+  static uint32_t lastMillis = 0;
+
+  bus.update();
+  master.handle();
+  for(uint8_t i=0; i<NODES_COUNT; i++) nodes[i]->handle();
+
+  if(!waiting) {
+    polled  = polled % NODES_COUNT + 1;
+    waiting = master.request(polled, DATA_ID, POLL_TIMEOUT_MS, replyMSP);
+  }
+
+  if(millis() - lastMillis >= 1000) {
+    Serial.print("Nodes: ");        Serial.print(NODES_COUNT);
+    Serial.print(" Throughput: ");  Serial.print(bus.throughput());     Serial.print(" B/s");
+    Serial.print(" Latency avg: "); Serial.print(bus.averageLatency()); Serial.print(" us");
+    Serial.print(" max: ");         Serial.print(bus.maxLatency());     Serial.print(" us");
+    Serial.print(" Collisions: ");  Serial.print(bus.collisions());
+    Serial.print(" Bit errors: ");  Serial.print(bus.bitErrors());
+    Serial.print(" Replies: ");     Serial.print(replies);
+    Serial.print(" Timeouts: ");    Serial.println(timeouts);
+    bus.resetStats();
+    replies = timeouts = 0;
+    lastMillis = millis();
+  }
+
+}
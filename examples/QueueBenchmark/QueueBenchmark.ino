@@ -0,0 +1,125 @@
+/* QueueBenchmark - example show TX queue throughput with several producers.
+ * ------------------------------------------------------------------------
+ * Description:
+ * A timer interrupt and LOOP_PRODUCERS producers in loop() put frames to
+ * the TX queue with queueData(), handle() writes them to the port.
+ * The loop() producers are called one after another in the same context,
+ * so they never preempt each other: the only concurrent producer is the
+ * timer interrupt. It is not a test of RTOS tasks on several cores.
+ * Every second the sketch prints frames queued and rejected (queue full)
+ * by the interrupt and by every loop() producer, total frames per second
+ * (every queued frame is sent) and the average time of one queueData()
+ * call in loop(). Change LOOP_PRODUCERS, ISR_RATE_HZ, MSP_BAUDRATE and
+ * MSP_TX_QUEUE_SIZE to see where the queue saturates.
+ * Timer API of STM32 core is used.
+ * ------------------------------------------------------------------------
+ * License:
+ * GNU General Public License v3.0
+ * https://github.com/denisn73/SmartSerial/blob/master/LICENSE
+ * ------------------------------------------------------------------------
+ * Author:
+ * Developed by Denis Silivanov
+ * VK: @silivanov
+ * Instagram: @denisfpv
+ * Copyright (c) Denis Silivanov 2018
+ * https://github.com/denisn73/SmartSerial
+ * ------------------------------------------------------------------------
+ */
+
+#include <SmartSerial.h>   // Smart Serial library
+
+//--------------------------------------------------------------------------------------------
+// *** Benchmark Configuration ***
+//--------------------------------------------------------------------------------------------
+
+#define MSP_SERIAL         Serial1
+#define MSP_BAUDRATE        921600
+#define ISR_RATE_HZ           2000 // timer producer rate
+#define LOOP_PRODUCERS           2 // producers called in every loop()
+#define ISR_DATA_ID              1
+#define LOOP_DATA_ID             2 // producer n sends LOOP_DATA_ID + n
+#define SAMPLE_SIZE              8 // bytes of array from timer
+
+//--------------------------------------------------------------------------------------------
+// *** Create MSP class object and timer ***
+//--------------------------------------------------------------------------------------------
+SmartSSP       MSP(&MSP_SERIAL);
+HardwareTimer  timer(TIM2);
+
+volatile uint32_t isrQueued   = 0;
+volatile uint32_t isrRejected = 0;
+uint32_t loopQueued[LOOP_PRODUCERS];
+uint32_t loopRejected[LOOP_PRODUCERS];
+uint32_t loopCalls    = 0;
+uint32_t loopMicros   = 0;
+
+//--------------------------------------------------------------------------------------------
+// *** Timer producer: runs in interrupt context ***
+//--------------------------------------------------------------------------------------------
+void timerISR() {
+  static uint8_t sample[SAMPLE_SIZE];
+  sample[0]++;
+  if(MSP.queueData(ISR_DATA_ID, sample, SAMPLE_SIZE)) isrQueued++;
+  else isrRejected++;
+}
+
+//--------------------------------------------------------------------------------------------
+// *** Loop producer n: value with own dataID ***
+//--------------------------------------------------------------------------------------------
+void produce(uint8_t n) {
+  uint32_t start = micros();
+  bool ok = MSP.queueData(LOOP_DATA_ID + n, (long)start);
+  loopMicros += micros() - start;
+  loopCalls++;
+  if(ok) loopQueued[n]++;
+  else loopRejected[n]++;
+}
+
+//--------------------------------------------------------------------------------------------
+// *** Setup function ***
+//--------------------------------------------------------------------------------------------
+void setup() {
+
+  Serial.begin(DEFAULT_BAUDRATE);
+  MSP.begin(MSP_BAUDRATE);
+
+  timer.setOverflow(ISR_RATE_HZ, HERTZ_FORMAT);
+  timer.attachInterrupt(timerISR);
+  timer.resume();
+
+}
+
+//--------------------------------------------------------------------------------------------
+// *** Loop function ***
+//--------------------------------------------------------------------------------------------
+void loop() {
+
+  static uint32_t lastMillis = 0;
+
+  for(uint8_t n=0; n<LOOP_PRODUCERS; n++) produce(n);
+
+  MSP.handle();
+
+  if(millis() - lastMillis >= 1000) {
+    noInterrupts();
+    uint32_t queued   = isrQueued;
+    uint32_t rejected = isrRejected;
+    isrQueued = isrRejected = 0;
+    interrupts();
+    uint32_t total = queued;
+    Serial.print("ISR queued: ");    Serial.print(queued);
+    Serial.print(" rejected: ");     Serial.print(rejected);
+    for(uint8_t n=0; n<LOOP_PRODUCERS; n++) {
+      Serial.print(" | Loop ");      Serial.print(n);
+      Serial.print(" queued: ");     Serial.print(loopQueued[n]);
+      Serial.print(" rejected: ");   Serial.print(loopRejected[n]);
+      total += loopQueued[n];
+      loopQueued[n] = loopRejected[n] = 0;
+    }
+    Serial.print(" | Total: ");      Serial.print(total); Serial.print(" frames/s");
+    Serial.print(" queueData: ");    Serial.print((float)loopMicros / loopCalls); Serial.println(" us");
+    loopCalls = loopMicros = 0;
+    lastMillis = millis();
+  }
+
+}